@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <bcrypt.h>
+#elif defined(__linux__)
+#include <errno.h>
+#include <sys/random.h>
+#endif
+
+#include "aes.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AES_AESNI_AVAILABLE
+#include <wmmintrin.h>
+#endif
+
+static const uint8_t sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+static inline uint8_t xtime(uint8_t x) {
+    return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1B : 0x00));
+}
+
+// Standard AES-128 key schedule, the round keys have the same layout for AES-NI
+static void expand_key(uint8_t* key, uint8_t* round_keys) {
+    memcpy(round_keys, key, AES_KEY_SIZE);
+
+    uint8_t rcon = 0x01;
+    for(int i = AES_KEY_SIZE; i < 176; i += 4) {
+        uint8_t temp[4];
+        memcpy(temp, round_keys + i - 4, 4);
+
+        if(i % AES_KEY_SIZE == 0) {
+            uint8_t first = temp[0];
+            temp[0] = sbox[temp[1]] ^ rcon;
+            temp[1] = sbox[temp[2]];
+            temp[2] = sbox[temp[3]];
+            temp[3] = sbox[first];
+            rcon = xtime(rcon);
+        }
+
+        for(int j = 0; j < 4; j++) {
+            round_keys[i + j] = round_keys[i + j - AES_KEY_SIZE] ^ temp[j];
+        }
+    }
+}
+
+// Portable implementation used when AES-NI is not available
+static void encrypt_block_portable(uint8_t* round_keys, uint8_t* in, uint8_t* out) {
+    uint8_t state[16];
+    for(int i = 0; i < 16; i++) {
+        state[i] = in[i] ^ round_keys[i];
+    }
+
+    for(int round = 1; round <= 10; round++) {
+        // SubBytes and ShiftRows (state is stored column by column)
+        uint8_t shifted[16];
+        for(int col = 0; col < 4; col++) {
+            for(int row = 0; row < 4; row++) {
+                shifted[col * 4 + row] = sbox[state[((col + row) % 4) * 4 + row]];
+            }
+        }
+
+        // MixColumns (skipped in the final round)
+        if(round != 10) {
+            for(int col = 0; col < 4; col++) {
+                uint8_t* c = shifted + col * 4;
+                uint8_t all = c[0] ^ c[1] ^ c[2] ^ c[3];
+                uint8_t first = c[0];
+                c[0] ^= all ^ xtime(c[0] ^ c[1]);
+                c[1] ^= all ^ xtime(c[1] ^ c[2]);
+                c[2] ^= all ^ xtime(c[2] ^ c[3]);
+                c[3] ^= all ^ xtime(c[3] ^ first);
+            }
+        }
+
+        for(int i = 0; i < 16; i++) {
+            state[i] = shifted[i] ^ round_keys[round * 16 + i];
+        }
+    }
+
+    memcpy(out, state, 16);
+}
+
+#ifdef AES_AESNI_AVAILABLE
+__attribute__((target("aes,sse2")))
+static void encrypt_block_aesni(uint8_t* round_keys, uint8_t* in, uint8_t* out) {
+    __m128i state = _mm_loadu_si128((__m128i*)in);
+    state = _mm_xor_si128(state, _mm_loadu_si128((__m128i*)round_keys));
+    for(int round = 1; round < 10; round++) {
+        state = _mm_aesenc_si128(state, _mm_loadu_si128((__m128i*)(round_keys + round * 16)));
+    }
+    state = _mm_aesenclast_si128(state, _mm_loadu_si128((__m128i*)(round_keys + 160)));
+    _mm_storeu_si128((__m128i*)out, state);
+}
+
+// Encrypts four counter blocks at once to hide the latency of the aesenc instruction
+__attribute__((target("aes,sse2")))
+static void encrypt_4_blocks_aesni(uint8_t* round_keys, uint8_t* in, uint8_t* out) {
+    __m128i key = _mm_loadu_si128((__m128i*)round_keys);
+    __m128i s0 = _mm_xor_si128(_mm_loadu_si128((__m128i*)in), key);
+    __m128i s1 = _mm_xor_si128(_mm_loadu_si128((__m128i*)(in + 16)), key);
+    __m128i s2 = _mm_xor_si128(_mm_loadu_si128((__m128i*)(in + 32)), key);
+    __m128i s3 = _mm_xor_si128(_mm_loadu_si128((__m128i*)(in + 48)), key);
+    for(int round = 1; round < 10; round++) {
+        key = _mm_loadu_si128((__m128i*)(round_keys + round * 16));
+        s0 = _mm_aesenc_si128(s0, key);
+        s1 = _mm_aesenc_si128(s1, key);
+        s2 = _mm_aesenc_si128(s2, key);
+        s3 = _mm_aesenc_si128(s3, key);
+    }
+    key = _mm_loadu_si128((__m128i*)(round_keys + 160));
+    _mm_storeu_si128((__m128i*)out, _mm_aesenclast_si128(s0, key));
+    _mm_storeu_si128((__m128i*)(out + 16), _mm_aesenclast_si128(s1, key));
+    _mm_storeu_si128((__m128i*)(out + 32), _mm_aesenclast_si128(s2, key));
+    _mm_storeu_si128((__m128i*)(out + 48), _mm_aesenclast_si128(s3, key));
+}
+#endif
+
+void aes_init(AesContext* ctx, uint8_t* key, uint8_t* iv) {
+    expand_key(key, ctx->round_keys);
+    memcpy(ctx->iv, iv, AES_BLOCK_SIZE);
+
+    #ifdef AES_AESNI_AVAILABLE
+    ctx->use_aesni = __builtin_cpu_supports("aes");
+    #else
+    ctx->use_aesni = false;
+    #endif
+}
+
+void aes_encrypt_block(AesContext* ctx, uint8_t* in, uint8_t* out) {
+    #ifdef AES_AESNI_AVAILABLE
+    if(ctx->use_aesni) {
+        encrypt_block_aesni(ctx->round_keys, in, out);
+        return;
+    }
+    #endif
+    encrypt_block_portable(ctx->round_keys, in, out);
+}
+
+// Writes the counter block for the given block index (iv + index, the last 8 bytes are a big endian counter)
+static inline void counter_block(AesContext* ctx, uint64_t block_index, uint8_t* counter) {
+    uint64_t low = 0;
+    for(int i = 8; i < 16; i++) {
+        low = (low << 8) | ctx->iv[i];
+    }
+    low += block_index;
+
+    memcpy(counter, ctx->iv, 8);
+    for(int i = 15; i >= 8; i--) {
+        counter[i] = (uint8_t)low;
+        low >>= 8;
+    }
+}
+
+// Generates the keystream block with the given index
+void aes_ctr_block(AesContext* ctx, uint64_t block_index, uint8_t* keystream) {
+    uint8_t counter[AES_BLOCK_SIZE];
+    counter_block(ctx, block_index, counter);
+    aes_encrypt_block(ctx, counter, keystream);
+}
+
+// XORs the keystream into the buffer, which starts at the given byte offset of the stream
+void aes_ctr_xor(AesContext* ctx, uint64_t offset, uint8_t* buffer, size_t length) {
+    uint64_t block_index = offset / AES_BLOCK_SIZE;
+    size_t block_offset = offset % AES_BLOCK_SIZE;
+    uint8_t keystream[4 * AES_BLOCK_SIZE];
+
+    #ifdef AES_AESNI_AVAILABLE
+    if(ctx->use_aesni) {
+        uint8_t counters[4 * AES_BLOCK_SIZE];
+        while(length >= 4 * AES_BLOCK_SIZE - block_offset) {
+            for(int i = 0; i < 4; i++) {
+                counter_block(ctx, block_index + i, counters + i * AES_BLOCK_SIZE);
+            }
+            encrypt_4_blocks_aesni(ctx->round_keys, counters, keystream);
+
+            size_t amount = 4 * AES_BLOCK_SIZE - block_offset;
+            for(size_t i = 0; i < amount; i++) {
+                buffer[i] ^= keystream[block_offset + i];
+            }
+
+            buffer += amount;
+            length -= amount;
+            block_index += 4;
+            block_offset = 0;
+        }
+    }
+    #endif
+
+    while(length > 0) {
+        aes_ctr_block(ctx, block_index, keystream);
+
+        size_t amount = AES_BLOCK_SIZE - block_offset;
+        if(amount > length) amount = length;
+        for(size_t i = 0; i < amount; i++) {
+            buffer[i] ^= keystream[block_offset + i];
+        }
+
+        buffer += amount;
+        length -= amount;
+        block_index++;
+        block_offset = 0;
+    }
+}
+
+// Fills the iv with random bytes from the random source of the operating system
+// Returns 1 if no random bytes are available, a predictable iv would allow reusing the keystream
+int aes_generate_iv(uint8_t* iv) {
+    #if defined(_WIN32)
+    NTSTATUS status = BCryptGenRandom(NULL, iv, AES_BLOCK_SIZE, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    return BCRYPT_SUCCESS(status) ? 0 : 1;
+    #elif defined(__linux__)
+    size_t amount_read = 0;
+    while(amount_read < AES_BLOCK_SIZE) {
+        ssize_t result = getrandom(iv + amount_read, AES_BLOCK_SIZE - amount_read, 0);
+        if(result < 0) {
+            if(errno == EINTR) continue;
+            return 1;
+        }
+        amount_read += (size_t)result;
+    }
+    return 0;
+    #elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+    arc4random_buf(iv, AES_BLOCK_SIZE);
+    return 0;
+    #else
+    FILE* random_device = fopen("/dev/urandom", "rb");
+    if(random_device == NULL) {
+        return 1;
+    }
+    size_t amount_read = fread(iv, 1, AES_BLOCK_SIZE, random_device);
+    fclose(random_device);
+    return amount_read == AES_BLOCK_SIZE ? 0 : 1;
+    #endif
+}
+
+// Parses a key given as 32 hexadecimal digits
+bool aes_parse_key(char* hex, uint8_t* key) {
+    if(strlen(hex) != 2 * AES_KEY_SIZE) {
+        return false;
+    }
+
+    for(int i = 0; i < 2 * AES_KEY_SIZE; i++) {
+        char c = hex[i];
+        uint8_t value;
+        if(c >= '0' && c <= '9') value = c - '0';
+        else if(c >= 'a' && c <= 'f') value = c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F') value = c - 'A' + 10;
+        else return false;
+
+        if(i % 2 == 0) key[i / 2] = value << 4;
+        else key[i / 2] |= value;
+    }
+
+    return true;
+}
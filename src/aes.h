@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define AES_BLOCK_SIZE 16
+#define AES_KEY_SIZE 16
+
+typedef struct AesContext {
+    uint8_t round_keys[176]; // AES-128 expanded key
+    uint8_t iv[AES_BLOCK_SIZE]; // Initial counter block
+    bool use_aesni;
+} AesContext;
+
+void aes_init(AesContext* ctx, uint8_t* key, uint8_t* iv);
+void aes_encrypt_block(AesContext* ctx, uint8_t* in, uint8_t* out);
+void aes_ctr_block(AesContext* ctx, uint64_t block_index, uint8_t* keystream);
+void aes_ctr_xor(AesContext* ctx, uint64_t offset, uint8_t* buffer, size_t length);
+int aes_generate_iv(uint8_t* iv);
+bool aes_parse_key(char* hex, uint8_t* key);
@@ -0,0 +1,347 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "archive.h"
+
+#define READ_CHUNK_SIZE 65536
+#define DECODE_BATCH_SEGMENTS 16 // Segments corrected at once (and split between the threads) when error correction is used
+
+int determine_max_content(ImageData data, int bits) {
+    int factor = 0; // Number of pixels or 0 if invalid
+
+    switch(data.type) {
+        case IMAGE_RGBA16:
+            if(bits < 3) factor = 4;
+            break;
+        case IMAGE_RGB24:
+            if(bits < 5) factor = 3;
+            break;
+        case IMAGE_RGBA32:
+            if(bits < 5) factor = 4;
+            break;
+        default: break;
+    }
+
+    return (factor * bits * data.width * data.height) / 8;
+}
+
+static inline int channels_per_pixel(ImageType type) {
+    return (type == IMAGE_RGBA16 || type == IMAGE_RGBA32) ? 4 : 3;
+}
+
+// Channel values in the order in which they are used for embedding
+static inline uint16_t channel_value(Pixel* pixel, int channel) {
+    switch(channel) {
+        case 0: return pixel->r;
+        case 1: return pixel->g;
+        case 2: return pixel->b;
+        default: return pixel->a;
+    }
+}
+
+// Length of the iv header in front of encrypted content
+// With error correction the iv gets its own (shortened) code word, as the content can only be decrypted with an intact iv
+size_t iv_header_length(PayloadSettings* settings) {
+    if(!settings->use_key) {
+        return 0;
+    }
+    return settings->use_ecc ? rs_encoded_length(AES_BLOCK_SIZE) : AES_BLOCK_SIZE;
+}
+
+// Corrects the iv header (if error correction is used), returns 1 if the iv is too damaged
+int decode_iv_header(PayloadSettings* settings, uint8_t* iv_header) {
+    size_t corrected_count;
+    return settings->use_ecc && rs_decode(iv_header, AES_BLOCK_SIZE, 1, &corrected_count) ? 1 : 0;
+}
+
+// Number of bytes embedded in the image for the given content length
+size_t payload_stream_length(PayloadSettings* settings, size_t content_length) {
+    return content_length + iv_header_length(settings);
+}
+
+// Length of the content for the given data length (including the error correction parity)
+size_t embedded_content_length(PayloadSettings* settings, size_t data_length) {
+    return settings->use_ecc ? rs_encoded_length(data_length) : data_length;
+}
+
+// Reads length bytes of the stream starting at stream_offset
+// The pixels of img_data begin with the pixel at index first_pixel of the image
+void read_stream(ImageData img_data, int bit_number, size_t first_pixel, size_t stream_offset, size_t length, uint8_t* buffer) {
+    if(length == 0) {
+        return;
+    }
+
+    int channels = channels_per_pixel(img_data.type);
+    uint8_t byte_mask = 0xFF >> (8 - bit_number);
+
+    // Bit position n of the stream is stored in channel n / bit_number
+    size_t channel = stream_offset * 8 / bit_number - first_pixel * channels;
+    int skip = stream_offset * 8 % bit_number;
+
+    uint32_t bits = (channel_value(img_data.buffer + channel / channels, channel % channels) & byte_mask) >> skip;
+    int bit_count = bit_number - skip;
+    channel++;
+
+    for(size_t i = 0; i < length; i++) {
+        while(bit_count < 8) {
+            bits |= (uint32_t)(channel_value(img_data.buffer + channel / channels, channel % channels) & byte_mask) << bit_count;
+            bit_count += bit_number;
+            channel++;
+        }
+
+        buffer[i] = (uint8_t)bits;
+        bits >>= 8;
+        bit_count -= 8;
+    }
+}
+
+// Reads length bytes of the stream starting at stream_offset, only the rows containing them are read from the file
+static int read_stream_from_file(PayloadReader* reader, size_t stream_offset, size_t length, uint8_t* buffer) {
+    if(length == 0) {
+        return 0;
+    }
+
+    ImageData header = reader->header;
+    int bit_number = reader->settings.bit_number;
+    size_t pixel_bits = (size_t)channels_per_pixel(header.type) * bit_number;
+    size_t first_row = stream_offset * 8 / pixel_bits / header.width;
+    size_t last_row = ((stream_offset + length) * 8 - 1) / pixel_bits / header.width;
+    if(last_row >= header.height) {
+        return 1;
+    }
+
+    size_t row_count = last_row - first_row + 1;
+    uint8_t* row_data = malloc(row_count * header.row_length);
+    if(fseek(reader->file, (long)(header.data_offset + first_row * header.row_length), SEEK_SET) ||
+            fread(row_data, 1, row_count * header.row_length, reader->file) != row_count * header.row_length) {
+        free(row_data);
+        return 1;
+    }
+
+    header.buffer = malloc(sizeof(Pixel) * row_count * header.width);
+    header.height = row_count;
+    decode_pixel_rows(header, row_data, row_count, header.buffer);
+    read_stream(header, bit_number, first_row * header.width, stream_offset, length, buffer);
+
+    free(header.buffer);
+    free(row_data);
+    return 0;
+}
+
+// Reads the header (and the iv header if a key is used) of an opened image file, the file is closed on an error
+ArchiveError init_payload_reader(PayloadReader* reader, FILE* file, PayloadSettings settings) {
+    reader->file = file;
+    reader->settings = settings;
+    reader->segments = NULL;
+    reader->segment_count = 0;
+    reader->corrected_count = 0;
+
+    // File header (14 bytes) and info header (40 bytes), all of it is required
+    uint8_t header_data[54] = { 0 };
+    size_t header_length = fread(header_data, 1, sizeof(header_data), reader->file);
+
+    reader->image_error = PARSE_ERROR_INVALID_LENGTH;
+    if(header_length == sizeof(header_data)) {
+        reader->header = parse_image_header(header_data, header_length, &reader->image_error);
+    }
+    if(reader->image_error) {
+        fclose(reader->file);
+        return ARCHIVE_ERROR_INVALID_IMAGE;
+    }
+
+    size_t content_length = embedded_content_length(&settings, (size_t)reader->header.reserved);
+    int max_size = determine_max_content(reader->header, settings.bit_number);
+    if(max_size <= 0 || payload_stream_length(&settings, content_length) > (size_t)max_size) {
+        fclose(reader->file);
+        return ARCHIVE_ERROR_INCORRECTLY_ENCODED;
+    }
+
+    if(settings.use_key) {
+        uint8_t iv_header[IV_HEADER_MAX_SIZE];
+        if(read_stream_from_file(reader, 0, iv_header_length(&settings), iv_header) || decode_iv_header(&settings, iv_header)) {
+            fclose(reader->file);
+            return ARCHIVE_ERROR_INCORRECTLY_ENCODED;
+        }
+        aes_init(&reader->aes, settings.key, iv_header);
+    }
+
+    if(settings.use_ecc) {
+        reader->segments = malloc(DECODE_BATCH_SEGMENTS * RS_SEGMENT_SIZE);
+    }
+
+    return ARCHIVE_ERROR_NO_ERROR;
+}
+
+void close_payload_reader(PayloadReader* reader) {
+    free(reader->segments);
+    fclose(reader->file);
+}
+
+// Reads (and decrypts) length bytes of the embedded content (with the parity if error correction is used)
+// The data is processed in chunks so that decryption runs on data that is still in the cache
+static int read_content(PayloadReader* reader, size_t offset, size_t length, uint8_t* buffer) {
+    size_t stream_offset = offset + iv_header_length(&reader->settings);
+
+    for(size_t done = 0; done < length; done += READ_CHUNK_SIZE) {
+        size_t chunk_length = length - done < READ_CHUNK_SIZE ? length - done : READ_CHUNK_SIZE;
+        if(read_stream_from_file(reader, stream_offset + done, chunk_length, buffer + done)) {
+            return 1;
+        }
+        if(reader->settings.use_key) {
+            aes_ctr_xor(&reader->aes, offset + done, buffer + done, chunk_length);
+        }
+    }
+
+    return 0;
+}
+
+// Reads and corrects count segments starting at first_segment into the segments of the reader
+static ArchiveError decode_segments(PayloadReader* reader, size_t first_segment, size_t count) {
+    size_t data_start = first_segment * RS_SEGMENT_DATA_SIZE;
+    size_t data_length = (size_t)reader->header.reserved - data_start;
+    if(data_length > count * RS_SEGMENT_DATA_SIZE) data_length = count * RS_SEGMENT_DATA_SIZE;
+
+    reader->segment_count = 0;
+    if(read_content(reader, first_segment * RS_SEGMENT_SIZE, rs_encoded_length(data_length), reader->segments)) {
+        return ARCHIVE_ERROR_INCORRECTLY_ENCODED;
+    }
+
+    size_t corrected_count;
+    if(rs_decode(reader->segments, data_length, reader->settings.thread_count, &corrected_count)) {
+        return ARCHIVE_ERROR_TOO_DAMAGED;
+    }
+
+    reader->corrected_count += corrected_count;
+    reader->first_segment = first_segment;
+    reader->segment_count = count;
+    return ARCHIVE_ERROR_NO_ERROR;
+}
+
+// Reads (and decrypts) length bytes of the payload starting at offset
+// With error correction only the segments covering the requested bytes are read and corrected
+ArchiveError read_payload(PayloadReader* reader, size_t offset, size_t length, uint8_t* buffer) {
+    if(!reader->settings.use_ecc) {
+        return read_content(reader, offset, length, buffer) ? ARCHIVE_ERROR_INCORRECTLY_ENCODED : ARCHIVE_ERROR_NO_ERROR;
+    }
+    else if(offset > (size_t)reader->header.reserved || length > (size_t)reader->header.reserved - offset) {
+        return ARCHIVE_ERROR_INCORRECTLY_ENCODED;
+    }
+
+    size_t done = 0;
+    while(done < length) {
+        size_t segment = (offset + done) / RS_SEGMENT_DATA_SIZE;
+        if(reader->segment_count == 0 || segment < reader->first_segment || segment >= reader->first_segment + reader->segment_count) {
+            size_t last_segment = (offset + length - 1) / RS_SEGMENT_DATA_SIZE;
+            size_t count = last_segment - segment + 1 < DECODE_BATCH_SEGMENTS ? last_segment - segment + 1 : DECODE_BATCH_SEGMENTS;
+            ArchiveError error = decode_segments(reader, segment, count);
+            if(error) {
+                return error;
+            }
+        }
+
+        // Copy the requested bytes from the decoded segments
+        size_t decoded_start = reader->first_segment * RS_SEGMENT_DATA_SIZE;
+        size_t decoded_end = decoded_start + reader->segment_count * RS_SEGMENT_DATA_SIZE;
+        size_t part_length = decoded_end - (offset + done) < length - done ? decoded_end - (offset + done) : length - done;
+        memcpy(buffer + done, reader->segments + (offset + done - decoded_start), part_length);
+        done += part_length;
+    }
+
+    return ARCHIVE_ERROR_NO_ERROR;
+}
+
+// Packs the files into an archive (see ArchiveEntry)
+// On an error NULL is returned and failed_entry is set to the entry whose name is invalid
+uint8_t* pack_archive(char** names, uint8_t** contents, size_t* lengths, int count, size_t* archive_length, ArchiveError* error, int* failed_entry) {
+    size_t total_length = ARCHIVE_HEADER_SIZE + sizeof(ArchiveEntry) * count;
+    for(int i = 0; i < count; i++) {
+        *failed_entry = i;
+        if(strlen(names[i]) >= ARCHIVE_NAME_SIZE || *names[i] == '\0') {
+            *error = ARCHIVE_ERROR_INVALID_NAME;
+            return NULL;
+        }
+
+        // Entries are looked up by name, so every name may only be used once
+        for(int j = 0; j < i; j++) {
+            if(strcmp(names[j], names[i]) == 0) {
+                *error = ARCHIVE_ERROR_DUPLICATE_NAME;
+                return NULL;
+            }
+        }
+
+        total_length += lengths[i];
+    }
+
+    uint8_t* buffer = malloc(total_length + 1); // Extra byte because get_bits may read the byte after the last one
+    memcpy(buffer, ARCHIVE_MAGIC, 4);
+    *(uint32_t*)(buffer + 4) = (uint32_t)count;
+
+    size_t offset = ARCHIVE_HEADER_SIZE + sizeof(ArchiveEntry) * count;
+    for(int i = 0; i < count; i++) {
+        ArchiveEntry entry = { 0 };
+        strcpy(entry.name, names[i]);
+        entry.offset = (uint32_t)offset;
+        entry.length = (uint32_t)lengths[i];
+
+        memcpy(buffer + ARCHIVE_HEADER_SIZE + sizeof(ArchiveEntry) * i, &entry, sizeof(ArchiveEntry));
+        memcpy(buffer + offset, contents[i], lengths[i]);
+        offset += lengths[i];
+    }
+
+    *error = ARCHIVE_ERROR_NO_ERROR;
+    *archive_length = total_length;
+    return buffer;
+}
+
+// Reads the index of an embedded archive, only the pixels holding the index are decoded
+ArchiveEntry* read_archive_index(PayloadReader* reader, uint32_t* entry_count, ArchiveError* error) {
+    size_t archive_length = (size_t)reader->header.reserved;
+    uint8_t archive_header[ARCHIVE_HEADER_SIZE];
+    if(archive_length < ARCHIVE_HEADER_SIZE) {
+        *error = ARCHIVE_ERROR_NO_ARCHIVE;
+        return NULL;
+    }
+    ArchiveError read_error = read_payload(reader, 0, ARCHIVE_HEADER_SIZE, archive_header);
+    if(read_error == ARCHIVE_ERROR_TOO_DAMAGED) {
+        *error = read_error;
+        return NULL;
+    }
+    else if(read_error || memcmp(archive_header, ARCHIVE_MAGIC, 4)) {
+        *error = ARCHIVE_ERROR_NO_ARCHIVE;
+        return NULL;
+    }
+
+    *error = ARCHIVE_ERROR_CORRUPT_INDEX;
+    *entry_count = *(uint32_t*)(archive_header + 4);
+    if(*entry_count > (archive_length - ARCHIVE_HEADER_SIZE) / sizeof(ArchiveEntry)) {
+        return NULL;
+    }
+
+    ArchiveEntry* entries = malloc(sizeof(ArchiveEntry) * (*entry_count + 1));
+    read_error = read_payload(reader, ARCHIVE_HEADER_SIZE, sizeof(ArchiveEntry) * *entry_count, (uint8_t*)entries);
+    if(read_error) {
+        if(read_error == ARCHIVE_ERROR_TOO_DAMAGED) *error = read_error;
+        free(entries);
+        return NULL;
+    }
+
+    for(uint32_t i = 0; i < *entry_count; i++) {
+        entries[i].name[ARCHIVE_NAME_SIZE - 1] = '\0';
+        if(entries[i].offset > archive_length || entries[i].length > archive_length - entries[i].offset) {
+            free(entries);
+            return NULL;
+        }
+    }
+
+    *error = ARCHIVE_ERROR_NO_ERROR;
+    return entries;
+}
+
+ArchiveEntry* find_archive_entry(ArchiveEntry* entries, uint32_t entry_count, char* name) {
+    for(uint32_t i = 0; i < entry_count; i++) {
+        if(strcmp(entries[i].name, name) == 0) {
+            return entries + i;
+        }
+    }
+    return NULL;
+}
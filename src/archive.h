@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "image-parser.h"
+#include "aes.h"
+#include "reed-solomon.h"
+
+// Archive layout: magic, entry count, fixed size index entries, file contents
+// Fixed size entries allow looking up entry i without reading the entries before it
+#define ARCHIVE_MAGIC "BHAR"
+#define ARCHIVE_HEADER_SIZE 8
+#define ARCHIVE_NAME_SIZE 56
+
+// Largest iv header: the iv followed by the parity of its own Reed-Solomon code word
+#define IV_HEADER_MAX_SIZE (AES_BLOCK_SIZE + RS_PARITY_SIZE)
+
+typedef struct ArchiveEntry {
+    char name[ARCHIVE_NAME_SIZE]; // Null terminated
+    uint32_t offset; // Offset from the start of the archive
+    uint32_t length;
+} ArchiveEntry;
+
+typedef enum ArchiveError {
+    ARCHIVE_ERROR_NO_ERROR,
+    ARCHIVE_ERROR_INVALID_NAME,
+    ARCHIVE_ERROR_DUPLICATE_NAME,
+    ARCHIVE_ERROR_INVALID_IMAGE, // The reason is stored in the image_error of the reader
+    ARCHIVE_ERROR_INCORRECTLY_ENCODED,
+    ARCHIVE_ERROR_TOO_DAMAGED,
+    ARCHIVE_ERROR_NO_ARCHIVE,
+    ARCHIVE_ERROR_CORRUPT_INDEX
+} ArchiveError;
+
+// Settings the payload was embedded with (they are not stored in the image)
+typedef struct PayloadSettings {
+    int bit_number;
+    bool use_key;
+    uint8_t key[AES_KEY_SIZE];
+    bool use_ecc;
+    int thread_count; // Threads used for error correction
+} PayloadSettings;
+
+// Random access to the payload of an image file, only the rows containing the requested bytes are read and decoded
+typedef struct PayloadReader {
+    FILE* file;
+    ImageData header;
+    ImageParseError image_error;
+    PayloadSettings settings;
+    AesContext aes;
+    uint8_t* segments; // Corrected data of the last decoded segments when error correction is used
+    size_t first_segment;
+    size_t segment_count; // Number of segments in segments (0 if there are none)
+    size_t corrected_count; // Number of bytes repaired by the error correction
+} PayloadReader;
+
+// Layout of the payload in the pixels
+int determine_max_content(ImageData data, int bits);
+size_t iv_header_length(PayloadSettings* settings);
+int decode_iv_header(PayloadSettings* settings, uint8_t* iv_header);
+size_t payload_stream_length(PayloadSettings* settings, size_t content_length);
+size_t embedded_content_length(PayloadSettings* settings, size_t data_length);
+void read_stream(ImageData img_data, int bit_number, size_t first_pixel, size_t stream_offset, size_t length, uint8_t* buffer);
+
+// Reading the payload from an image file
+ArchiveError init_payload_reader(PayloadReader* reader, FILE* file, PayloadSettings settings);
+void close_payload_reader(PayloadReader* reader);
+ArchiveError read_payload(PayloadReader* reader, size_t offset, size_t length, uint8_t* buffer);
+
+// Archive container
+uint8_t* pack_archive(char** names, uint8_t** contents, size_t* lengths, int count, size_t* archive_length, ArchiveError* error, int* failed_entry);
+ArchiveEntry* read_archive_index(PayloadReader* reader, uint32_t* entry_count, ArchiveError* error);
+ArchiveEntry* find_archive_entry(ArchiveEntry* entries, uint32_t entry_count, char* name);
@@ -3,8 +3,21 @@
 #include "image-parser.h"
 #include "macros.h"
 
-// Bitmap file format
-ImageData parse_image(uint8_t* raw_data, size_t length, ImageParseError* parse_error) {
+static int get_image_depth(ImageType type) {
+    switch(type) {
+        case IMAGE_RGBA16:
+            return 16;
+        case IMAGE_RGB24:
+            return 24;
+        case IMAGE_RGBA32:
+            return 32;
+        default:
+            return 0;
+    }
+}
+
+// Bitmap file format (only the header, the pixel buffer is left empty)
+ImageData parse_image_header(uint8_t* raw_data, size_t length, ImageParseError* parse_error) {
     ImageData parsed = { 0 };
     
     if(length < 34) {
@@ -17,7 +30,7 @@ ImageData parse_image(uint8_t* raw_data, size_t length, ImageParseError* parse_e
     }
 
     uint32_t reserved = *(uint32_t*)(raw_data + 6);
-    uint8_t data_start = *(uint32_t*)(raw_data + 10);
+    uint32_t data_start = *(uint32_t*)(raw_data + 10);
     uint32_t width = *(uint32_t*)(raw_data + 18);
     uint32_t height = *(uint32_t*)(raw_data + 22);
     uint16_t image_depth = *(uint16_t*)(raw_data + 28);
@@ -25,8 +38,7 @@ ImageData parse_image(uint8_t* raw_data, size_t length, ImageParseError* parse_e
     int32_t res_hoz = *(uint32_t*)(raw_data + 38);
     int32_t res_vrt = *(uint32_t*)(raw_data + 42);
 
-    int padding = 4 - (((width * image_depth) / 8) % 4);
-    int row_size = width * height * image_depth / 8 + height * padding;
+    int padding = (4 - (((width * image_depth) / 8) % 4)) % 4; // Rows are padded to a multiple of 4 bytes
 
     if(compression != 0) {
         *parse_error = PARSE_ERROR_COMPRESSION_NOT_SUPPORTED;
@@ -36,43 +48,14 @@ ImageData parse_image(uint8_t* raw_data, size_t length, ImageParseError* parse_e
         *parse_error = PARSE_ERROR_MINIMUM_PIXEL_SIZE_16;
         return parsed;
     }
-    else if(length < (size_t)(data_start + row_size)) {
-        *parse_error = PARSE_ERROR_INVALID_LENGTH;
-        return parsed;
-    }
-
-    Pixel* pixel_arr = (Pixel*)malloc(sizeof(Pixel) * width * height);
-    for(int i = 0; (size_t)i < width * height; i++) {
-        int index = data_start + i * image_depth / 8 + (i / width) * padding;
-
-        Pixel currentPixel;
-        if(image_depth == 16) {
-            currentPixel.b = raw_data[index] & 0x0F;
-            currentPixel.g = raw_data[index] & 0xF0;
-            currentPixel.r = raw_data[index + 1] & 0x0F;
-            currentPixel.a = raw_data[index + 1] & 0xF0;
-        }
-        else if(image_depth == 24) {
-            currentPixel.b = raw_data[index];
-            currentPixel.g = raw_data[index + 1];
-            currentPixel.r = raw_data[index + 2];
-        }
-        else if(image_depth == 32) {
-            currentPixel.b = (raw_data[index] + ((uint16_t)raw_data[index + 1] << 8)) & 0x1FF;
-            currentPixel.g = (raw_data[index + 1] + ((uint16_t)raw_data[index + 2] << 8)) & 0x1FE;
-            currentPixel.r = raw_data[index + 2] & 0xFE;
-            currentPixel.a = raw_data[index + 3] & 0x1F;
-        }
-
-        pixel_arr[i] = currentPixel;
-    }
 
-    parsed.buffer = pixel_arr;
     parsed.height = height;
     parsed.width = width;
     parsed.resolution_horizontal = res_hoz;
     parsed.resolution_vertical = res_vrt;
     parsed.reserved = reserved;
+    parsed.data_offset = data_start;
+    parsed.row_length = width * image_depth / 8 + padding;
     switch(image_depth) {
         case 16:
             parsed.type = IMAGE_RGBA16; break;
@@ -86,19 +69,63 @@ ImageData parse_image(uint8_t* raw_data, size_t length, ImageParseError* parse_e
     return parsed;
 }
 
+// Decodes row_count rows of the pixel array (starting at row_data) into pixels
+void decode_pixel_rows(ImageData header, uint8_t* row_data, size_t row_count, Pixel* pixels) {
+    int image_depth = get_image_depth(header.type);
+
+    for(size_t row = 0; row < row_count; row++) {
+        uint8_t* row_start = row_data + row * header.row_length;
+
+        for(size_t column = 0; column < header.width; column++) {
+            uint8_t* pixel_data = row_start + column * image_depth / 8;
+
+            Pixel currentPixel = { 0 };
+            if(image_depth == 16) {
+                currentPixel.b = pixel_data[0] & 0x0F;
+                currentPixel.g = pixel_data[0] & 0xF0;
+                currentPixel.r = pixel_data[1] & 0x0F;
+                currentPixel.a = pixel_data[1] & 0xF0;
+            }
+            else if(image_depth == 24) {
+                currentPixel.b = pixel_data[0];
+                currentPixel.g = pixel_data[1];
+                currentPixel.r = pixel_data[2];
+            }
+            else if(image_depth == 32) {
+                currentPixel.b = (pixel_data[0] + ((uint16_t)pixel_data[1] << 8)) & 0x1FF;
+                currentPixel.g = (pixel_data[1] + ((uint16_t)pixel_data[2] << 8)) & 0x1FE;
+                currentPixel.r = pixel_data[2] & 0xFE;
+                currentPixel.a = pixel_data[3] & 0x1F;
+            }
+
+            pixels[row * header.width + column] = currentPixel;
+        }
+    }
+}
+
+// Bitmap file format
+ImageData parse_image(uint8_t* raw_data, size_t length, ImageParseError* parse_error) {
+    ImageData parsed = parse_image_header(raw_data, length, parse_error);
+    if(*parse_error) {
+        return parsed;
+    }
+    else if(length < parsed.data_offset + parsed.height * parsed.row_length) {
+        *parse_error = PARSE_ERROR_INVALID_LENGTH;
+        return parsed;
+    }
+
+    parsed.buffer = (Pixel*)malloc(sizeof(Pixel) * parsed.width * parsed.height);
+    decode_pixel_rows(parsed, raw_data + parsed.data_offset, parsed.height, parsed.buffer);
+
+    return parsed;
+}
+
 uint8_t* create_image_file(ImageData data, size_t* data_length) {
-    uint16_t image_depth;
-    switch(data.type) {
-        case IMAGE_RGBA16:
-            image_depth = 16; break;
-        case IMAGE_RGB24:
-            image_depth = 24; break;
-        case IMAGE_RGBA32:
-            image_depth = 32; break;
-        default:
-            return NULL;
+    uint16_t image_depth = get_image_depth(data.type);
+    if(image_depth == 0) {
+        return NULL;
     }
-    int padding = 4 - (((data.width * image_depth) / 8) % 4);
+    int padding = (4 - (((data.width * image_depth) / 8) % 4)) % 4;
     
     uint32_t header_size = 54;
     uint32_t image_size = data.height * data.width * image_depth / 8 + data.height * padding;
@@ -1,4 +1,7 @@
+#pragma once
+
 #include <stdint.h>
+#include <stddef.h>
 
 typedef enum ImageType {
     IMAGE_NONE,
@@ -30,8 +33,12 @@ typedef struct ImageData {
     int32_t resolution_horizontal;
     int32_t resolution_vertical;
     int32_t reserved; // Contains data size
+    uint32_t data_offset; // Offset of the pixel array in the file
+    size_t row_length; // Length of a row in the file (including padding)
 } ImageData;
 
 ImageData parse_image(uint8_t* raw_data, size_t length, ImageParseError* parse_error);
+ImageData parse_image_header(uint8_t* raw_data, size_t length, ImageParseError* parse_error);
+void decode_pixel_rows(ImageData header, uint8_t* row_data, size_t row_count, Pixel* pixels);
 uint8_t* create_image_file(ImageData data, size_t* data_length);
 void free_image_data(ImageData data);
\ No newline at end of file
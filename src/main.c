@@ -3,8 +3,22 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "image-parser.h"
+#include "aes.h"
+#include "reed-solomon.h"
+#include "archive.h"
 #include "macros.h"
 
 // Constants
@@ -13,19 +27,64 @@
 #define PROJ_VERSION "v0.1.0"
 
 #define FILE_BUFFER_SIZE 2048
+#define METRICS_FLUSH_INTERVAL 65536 // Pixels after which the 32-bit squared error sums are moved to 64 bits (65536 * 255^2 < 2^32)
+
+// Payload stream used by embed_content and retrieve_content
+// When encrypting, the stream starts with the iv header and the content is encrypted in CTR mode
+// inside the pixel loop, using a window of two stream blocks
+typedef struct PayloadStream {
+    uint8_t* content;
+    size_t content_length;
+    size_t stream_length;
+    bool encrypted;
+    PayloadSettings settings;
+    AesContext aes;
+    uint8_t iv_header[IV_HEADER_MAX_SIZE];
+    int iv_header_length;
+    bool iv_damaged; // The iv could not be corrected
+    uint8_t window[2 * AES_BLOCK_SIZE];
+    int window_start; // Stream offset of window[0]
+} PayloadStream;
+
+// Distortion caused by embedding, accumulated by embed_content from the old and new channel values
+typedef struct EmbedMetrics {
+    uint64_t squared_error[4]; // Sum of the squared differences per channel (r, g, b, a)
+    uint64_t changed_pixels;
+    uint64_t pixel_count;
+} EmbedMetrics;
+
+// Running sums of embed_content, the four channels of a pixel are added as lanes of one SSE2 register
+typedef struct MetricsAccumulator {
+    #if defined(__SSE2__)
+    __m128i partial_sums;
+    #else
+    uint32_t partial_sums[4];
+    #endif
+    uint32_t pending_pixels; // Pixels added to partial_sums since the last flush
+    EmbedMetrics* metrics;
+} MetricsAccumulator;
 
 // Function definitions
 static void print_help_message(void);
 static int handle_embed_file();
 static int handle_print_size();
 static int handle_reverse();
+static int handle_list();
+static int handle_extract();
 static char* get_image_parser_error_message(ImageParseError error);
+static char* get_archive_error_message(ArchiveError error);
 static int read_args(int argc, char** argv);
-static int embed_content(ImageData img_data, uint8_t* content, size_t content_length);
+static int embed_content(ImageData img_data, uint8_t* content, size_t content_length, EmbedMetrics* metrics);
+static void print_embed_metrics(EmbedMetrics metrics);
 static uint8_t* retrieve_content(ImageData img_data, size_t* content_size);
 static uint8_t* read_file(char* filename, size_t* amount_read);
 static int write_file(char* filename, uint8_t* buffer, size_t length);
-static int determine_max_content(ImageData data, int bits);
+static int determine_thread_count(void);
+static PayloadSettings payload_settings(void);
+static uint8_t* create_archive(size_t* archive_length);
+static int open_payload_reader(PayloadReader* reader, char* filename);
+static void finish_payload_reader(PayloadReader* reader);
+static bool parse_range(char* arg);
 
 // Tests in debug mode
 #ifndef NDEBUG
@@ -33,14 +92,26 @@ static void run_tests();
 #endif
 
 // Globals
-char* data_file = NULL;
+char** data_files = NULL;
+int data_file_count = 0;
 char* image_file = NULL;
 char* outfile = NULL;
 bool print_help = false;
 bool print_version = false;
 bool print_size = false;
 bool reverse = false;
+bool archive = false;
+bool list_archive = false;
+char* extract_name = NULL;
+bool use_range = false;
+size_t range_offset = 0;
+size_t range_length = 0;
 int bit_number = 2;
+bool use_key = false;
+uint8_t key[AES_KEY_SIZE];
+bool use_ecc = false;
+bool print_metrics = false;
+int thread_count = 0; // 0 = number of processors
 
 int main(int argc, char** argv) {
     #ifndef NDEBUG
@@ -52,6 +123,9 @@ int main(int argc, char** argv) {
     if(exit_code) {
         return exit_code;
     }
+    if(thread_count <= 0) {
+        thread_count = determine_thread_count();
+    }
     
     // Handle read arguments
     if(print_help) {
@@ -67,13 +141,23 @@ int main(int argc, char** argv) {
     else if(print_size) {
         handle_print_size();
     }
+    else if(list_archive) {
+        return handle_list();
+    }
+    else if(extract_name != NULL || use_range) {
+        return handle_extract();
+    }
     else if(reverse) {
         handle_reverse();
     }
-    else if(data_file == NULL) {
+    else if(data_file_count == 0) {
         eprintf("Error: The argument DATAFILE is required when embedding a file\n");
         return 1;
     }
+    else if(data_file_count > 1 && !archive) {
+        eprintf("Error: Multiple data files can only be embedded as an archive (-a)\n");
+        return 1;
+    }
     else {
         int error = handle_embed_file();
         return error;
@@ -87,15 +171,30 @@ static int handle_embed_file() {
 
     size_t data_file_size;
     size_t image_file_size;
-    uint8_t* data_file_contents = read_file(data_file, &data_file_size);
-    data_file_contents = realloc(data_file_contents, data_file_size + 4); // Garbage data at end to stop segfault
+    uint8_t* data_file_contents;
+    if(archive) {
+        data_file_contents = create_archive(&data_file_size);
+        if(data_file_contents == NULL) {
+            return 1;
+        }
+    }
+    else {
+        data_file_contents = read_file(data_files[0], &data_file_size);
+        if(data_file_contents == NULL) {
+            eprintf("Error: File '%s' could not be read\n", data_files[0]);
+            return 1;
+        }
+    }
+    PayloadSettings settings = payload_settings();
+    size_t content_length = embedded_content_length(&settings, data_file_size);
+    data_file_contents = realloc(data_file_contents, content_length + 4); // Garbage data at end to stop segfault
+    if(use_ecc) {
+        rs_encode(data_file_contents, data_file_size, thread_count);
+    }
     uint8_t* image_file_contents = read_file(image_file, &image_file_size);
 
-    if(data_file_contents == NULL) {
-        eprintf("Error: File '%s' could not be read\n", data_file);
-        return 1;
-    }
-    else if(image_file_contents == NULL) {
+    if(image_file_contents == NULL) {
+        free(data_file_contents);
         eprintf("Error: File '%s' could not be read\n", image_file);
         return 1;
     }
@@ -110,12 +209,26 @@ static int handle_embed_file() {
         eprintf("Error: %s\n", get_image_parser_error_message(error));
         return 1;
     }
+    else if(print_metrics && image.type != IMAGE_RGB24) {
+        free(data_file_contents);
+        free(image_file_contents);
+        free_image_data(image);
+        eprintf("Error: The metrics can only be displayed for 24-bit images\n");
+        return 1;
+    }
 
-    int error_int = embed_content(image, data_file_contents, data_file_size);
-    if(error) {
+    EmbedMetrics metrics;
+    int error_int = embed_content(image, data_file_contents, content_length, &metrics);
+    if(error_int) {
         free(data_file_contents);
         free(image_file_contents);
-        eprintf("Error: The file was to large to embed into the image with the current bit setting\n");
+        free_image_data(image);
+        if(error_int == 2) {
+            eprintf("Error: No random numbers for the encryption iv could be generated\n");
+        }
+        else {
+            eprintf("Error: The file was to large to embed into the image with the current bit setting\n");
+        }
         return 1;
     }
 
@@ -126,6 +239,9 @@ static int handle_embed_file() {
         eprintf("Error: Failed to write to file\n");
         return_code = 1;
     }
+    else if(print_metrics) {
+        print_embed_metrics(metrics);
+    }
     
     free(new_file_data);
     free_image_data(image);
@@ -157,10 +273,24 @@ static int handle_reverse() {
     size_t content_length;
     uint8_t* content = retrieve_content(image, &content_length);
 
+    size_t failed_count = 0;
+    if(content != NULL && use_ecc) {
+        size_t corrected_count;
+        content_length = (size_t)image.reserved;
+        failed_count = rs_decode(content, content_length, thread_count, &corrected_count);
+        if(corrected_count > 0) {
+            eprintf("Corrected %zu damaged bytes\n", corrected_count);
+        }
+    }
+
     if(content == NULL) {
         eprintf("Error: The file was incorrectly encoded\n");
         return_code = 1;
     }
+    else if(failed_count > 0) {
+        eprintf("Error: %zu blocks of the embedded data are too damaged to be corrected\n", failed_count);
+        return_code = 1;
+    }
     else {
         int error_int = write_file(outfile == NULL ? "out.bin" : outfile, content, content_length);
         if(error_int) {
@@ -176,6 +306,88 @@ static int handle_reverse() {
     return return_code;
 }
 
+static int handle_list() {
+    PayloadReader reader;
+    if(open_payload_reader(&reader, image_file)) {
+        return 1;
+    }
+
+    uint32_t entry_count;
+    ArchiveError error;
+    ArchiveEntry* entries = read_archive_index(&reader, &entry_count, &error);
+    finish_payload_reader(&reader);
+    if(error) {
+        eprintf("Error: %s\n", get_archive_error_message(error));
+        return 1;
+    }
+
+    for(uint32_t i = 0; i < entry_count; i++) {
+        printf("%10u  %s\n", entries[i].length, entries[i].name);
+    }
+
+    free(entries);
+    return 0;
+}
+
+static int handle_extract() {
+    PayloadReader reader;
+    if(open_payload_reader(&reader, image_file)) {
+        return 1;
+    }
+
+    size_t offset = 0;
+    size_t length = (size_t)reader.header.reserved;
+
+    if(extract_name != NULL) {
+        uint32_t entry_count;
+        ArchiveError error;
+        ArchiveEntry* entries = read_archive_index(&reader, &entry_count, &error);
+        if(error) {
+            finish_payload_reader(&reader);
+            eprintf("Error: %s\n", get_archive_error_message(error));
+            return 1;
+        }
+
+        ArchiveEntry* entry = find_archive_entry(entries, entry_count, extract_name);
+        if(entry == NULL) {
+            free(entries);
+            finish_payload_reader(&reader);
+            eprintf("Error: The archive does not contain the file '%s'\n", extract_name);
+            return 1;
+        }
+
+        offset = entry->offset;
+        length = entry->length;
+        free(entries);
+    }
+
+    if(use_range) {
+        if(range_offset > length || range_length > length - range_offset) {
+            finish_payload_reader(&reader);
+            eprintf("Error: The range exceeds the size of the embedded data (%zu bytes)\n", length);
+            return 1;
+        }
+        offset += range_offset;
+        length = range_length;
+    }
+
+    int return_code = 0;
+    uint8_t* content = malloc(length + 1);
+    ArchiveError error = read_payload(&reader, offset, length, content);
+    if(error) {
+        eprintf("Error: %s\n", get_archive_error_message(error));
+        return_code = 1;
+    }
+    else if(write_file(outfile == NULL ? "out.bin" : outfile, content, length)) {
+        eprintf("Error: Failed to write to file\n");
+        return_code = 1;
+    }
+
+    free(content);
+    finish_payload_reader(&reader);
+    return return_code;
+}
+
 static int handle_print_size() {
     size_t image_file_size;
     uint8_t* image_file_contents = read_file(image_file, &image_file_size);
@@ -194,6 +406,14 @@ static int handle_print_size() {
     }
 
     int byte_num = determine_max_content(image, bit_number);
+
+    // Space taken by the iv and the error correction
+    PayloadSettings settings = payload_settings();
+    size_t header_length = payload_stream_length(&settings, 0);
+    size_t usable = (size_t)byte_num > header_length ? (size_t)byte_num - header_length : 0;
+    if(byte_num > 0) {
+        byte_num = (int)(use_ecc ? rs_max_data_length(usable) : usable);
+    }
     
     free_image_data(image);
     free(image_file_contents);
@@ -215,16 +435,28 @@ static void print_help_message(void) {
     printf("     -h (--help)                    Displays this help message\n");
     printf("     -v (--version)                 Displays the version\n");
     printf("     -i (--image-file) IMAGEFILE    Accepts the image file name (required)\n");
-    printf("     -d (--data-file) DATAFILE      Accepts the data file name\n");
+    printf("     -d (--data-file) DATAFILE      Accepts the data file name (can be repeated with -a)\n");
     printf("     -o (--out-file) OUTFILE        Accepts the output file name\n");
     printf("     -s (--max-size)                Displays the maximum size (in bytes) that can be embedded in the image\n");
     printf("     -b (--bit-number) BITNUM       Accepts number of bits used for embedding\n");
     printf("     -r (--reverse)                 Retrieves an embedded file created using this tool\n");
+    printf("     -k (--key) KEY                 Encrypts/decrypts the embedded data with AES-128 in CTR mode\n");
+    printf("     -a (--archive)                 Embeds all data files as an archive\n");
+    printf("     -l (--list)                    Lists the files of an embedded archive\n");
+    printf("     -x (--extract) NAME            Retrieves the file NAME from an embedded archive\n");
+    printf("     -R (--range) RANGE             Retrieves only a range of the embedded data (or of the file given by -x)\n");
+    printf("     -e (--ecc)                     Protects the embedded data with Reed-Solomon error correction\n");
+    printf("     -t (--threads) THREADS         Accepts the number of threads used for error correction\n");
+    printf("     -m (--metrics)                 Displays the distortion (MSE, PSNR, changed pixels) caused by embedding (24-bit images)\n");
     printf("ARGUMENTS:\n");
     printf("     IMAGEFILE                      The image file in/from which data should be hidden/retrieved\n");
     printf("     DATAFILE                       The file containing the data to hide\n");
     printf("     OUTFILE                        The file to which generated output should be written\n");
     printf("     BITNUM                         The number of less significant bits to use for embedding\n");
+    printf("     KEY                            The key as 32 hexadecimal digits\n");
+    printf("     NAME                           The name of a file in the archive (see -l)\n");
+    printf("     RANGE                          The range as OFFSET:LENGTH in bytes\n");
+    printf("     THREADS                        The number of threads (default: number of processors)\n");
 }
 
 static char* get_image_parser_error_message(ImageParseError error) {
@@ -241,6 +473,25 @@ static char* get_image_parser_error_message(ImageParseError error) {
     }
 }
 
+static char* get_archive_error_message(ArchiveError error) {
+    switch(error) {
+        case ARCHIVE_ERROR_INVALID_NAME:
+            return "The file name is empty or too long for an archive entry";
+        case ARCHIVE_ERROR_DUPLICATE_NAME:
+            return "The file name is used more than once in the archive";
+        case ARCHIVE_ERROR_INCORRECTLY_ENCODED:
+            return "The file was incorrectly encoded";
+        case ARCHIVE_ERROR_TOO_DAMAGED:
+            return "The embedded data is too damaged to be corrected";
+        case ARCHIVE_ERROR_NO_ARCHIVE:
+            return "The image does not contain an archive";
+        case ARCHIVE_ERROR_CORRUPT_INDEX:
+            return "The archive index is corrupt";
+        default:
+            return NULL; // Should never happen
+    }
+}
+
 static int read_args(int argc, char** argv) {
     if(argc == 1) {
         eprintf("Error: No arguments were given\n");
@@ -266,7 +517,8 @@ static int read_args(int argc, char** argv) {
         }
         else if(!strcmp(arg, "-d") || !strcmp(arg, "--data-file")) {
             if(i + 1 < argc) {
-                data_file = argv[i + 1];
+                data_files = realloc(data_files, sizeof(char*) * (data_file_count + 1));
+                data_files[data_file_count++] = argv[i + 1];
                 i++;
             }
             else val_expected = true;
@@ -277,6 +529,10 @@ static int read_args(int argc, char** argv) {
         else if(!strcmp(arg, "-b") || !strcmp(arg, "--bit-number")) {
             if(i + 1 < argc) {
                 bit_number = atoi(argv[i + 1]);
+                if(bit_number < 1 || bit_number > 8) {
+                    eprintf("Error: The bit number must be between 1 and 8\n");
+                    return 1;
+                }
                 i++;
             }
             else val_expected = true;
@@ -291,6 +547,54 @@ static int read_args(int argc, char** argv) {
         else if(!strcmp(arg, "-r") || !strcmp(arg, "--reverse")) {
             reverse = true;
         }
+        else if(!strcmp(arg, "-a") || !strcmp(arg, "--archive")) {
+            archive = true;
+        }
+        else if(!strcmp(arg, "-l") || !strcmp(arg, "--list")) {
+            list_archive = true;
+        }
+        else if(!strcmp(arg, "-x") || !strcmp(arg, "--extract")) {
+            if(i + 1 < argc) {
+                extract_name = argv[i + 1];
+                i++;
+            }
+            else val_expected = true;
+        }
+        else if(!strcmp(arg, "-R") || !strcmp(arg, "--range")) {
+            if(i + 1 < argc) {
+                if(!parse_range(argv[i + 1])) {
+                    eprintf("Error: The range must have the format OFFSET:LENGTH\n");
+                    return 1;
+                }
+                use_range = true;
+                i++;
+            }
+            else val_expected = true;
+        }
+        else if(!strcmp(arg, "-m") || !strcmp(arg, "--metrics")) {
+            print_metrics = true;
+        }
+        else if(!strcmp(arg, "-e") || !strcmp(arg, "--ecc")) {
+            use_ecc = true;
+        }
+        else if(!strcmp(arg, "-t") || !strcmp(arg, "--threads")) {
+            if(i + 1 < argc) {
+                thread_count = atoi(argv[i + 1]);
+                i++;
+            }
+            else val_expected = true;
+        }
+        else if(!strcmp(arg, "-k") || !strcmp(arg, "--key")) {
+            if(i + 1 < argc) {
+                if(!aes_parse_key(argv[i + 1], key)) {
+                    eprintf("Error: The key must consist of 32 hexadecimal digits\n");
+                    return 1;
+                }
+                use_key = true;
+                i++;
+            }
+            else val_expected = true;
+        }
         else {
             eprintf("Error: Unexpected argument '%s'\n", arg);
             return 1;
@@ -305,6 +609,25 @@ static int read_args(int argc, char** argv) {
     return 0;
 }
 
+// Parses a range given as OFFSET:LENGTH
+static bool parse_range(char* arg) {
+    char* end;
+    unsigned long long offset = strtoull(arg, &end, 10);
+    if(end == arg || *end != ':') {
+        return false;
+    }
+
+    char* length_start = end + 1;
+    unsigned long long length = strtoull(length_start, &end, 10);
+    if(end == length_start || *end != '\0') {
+        return false;
+    }
+
+    range_offset = (size_t)offset;
+    range_length = (size_t)length;
+    return true;
+}
+
 static uint8_t* read_file(char* filename, size_t* size_read) {
     FILE* file = fopen(filename, "rb");
     if(file == NULL) {
@@ -345,23 +668,75 @@ static int write_file(char* filename, uint8_t* buffer, size_t length) {
     return 0;
 }
 
-static int determine_max_content(ImageData data, int bits) {
-    int factor = 0; // Number of pixels or 0 if invalid
-    
-    switch(data.type) {
-        case IMAGE_RGBA16:
-            if(bits < 3) factor = 4;
-            break;
-        case IMAGE_RGB24:
-            if(bits < 5) factor = 3;
-            break;
-        case IMAGE_RGBA32:
-            if(bits < 5) factor = 4;
+// Packs all data files into an archive, the name of an entry is the file name without its directory
+static uint8_t* create_archive(size_t* archive_length) {
+    char** names = malloc(sizeof(char*) * data_file_count);
+    uint8_t** contents = malloc(sizeof(uint8_t*) * data_file_count);
+    size_t* lengths = malloc(sizeof(size_t) * data_file_count);
+    uint8_t* buffer = NULL;
+
+    int read_count;
+    for(read_count = 0; read_count < data_file_count; read_count++) {
+        names[read_count] = data_files[read_count];
+        for(char* c = data_files[read_count]; *c; c++) {
+            if(*c == '/' || *c == '\\') names[read_count] = c + 1;
+        }
+
+        contents[read_count] = read_file(data_files[read_count], lengths + read_count);
+        if(contents[read_count] == NULL) {
+            eprintf("Error: File '%s' could not be read\n", data_files[read_count]);
             break;
-        default: break;
+        }
     }
 
-    return (factor * bits * data.width * data.height) / 8;
+    if(read_count == data_file_count) {
+        ArchiveError error;
+        int failed_entry;
+        buffer = pack_archive(names, contents, lengths, data_file_count, archive_length, &error, &failed_entry);
+        if(error) {
+            eprintf("Error: %s ('%s')\n", get_archive_error_message(error), names[failed_entry]);
+        }
+    }
+
+    for(int i = 0; i < read_count; i++) {
+        free(contents[i]);
+    }
+    free(lengths);
+    free(contents);
+    free(names);
+    return buffer;
+}
+
+static int determine_thread_count(void) {
+    #if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+    #elif defined(_SC_NPROCESSORS_ONLN)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+    #else
+    return 1;
+    #endif
+}
+
+// Settings of the payload given by the arguments
+static PayloadSettings payload_settings(void) {
+    PayloadSettings settings = { .bit_number = bit_number, .use_key = use_key, .use_ecc = use_ecc, .thread_count = thread_count };
+    memcpy(settings.key, key, AES_KEY_SIZE);
+    return settings;
+}
+
+static void init_payload_stream(PayloadStream* stream, uint8_t* content, size_t content_length) {
+    stream->settings = payload_settings();
+    stream->content = content;
+    stream->content_length = content_length;
+    stream->stream_length = payload_stream_length(&stream->settings, content_length);
+    stream->encrypted = stream->settings.use_key;
+    stream->iv_header_length = (int)iv_header_length(&stream->settings);
+    stream->iv_damaged = false;
+    stream->window_start = 0;
+    memset(stream->window, 0, sizeof(stream->window));
 }
 
 
@@ -393,41 +768,176 @@ static inline uint16_t get_bits(uint8_t* content, int byte, int bit) {
     }
 }
 
-static int embed_content(ImageData img_data, uint8_t* content, size_t content_length) {
-    size_t max_size = (size_t)determine_max_content(img_data, bit_number);
-    if(max_size < content_length) {
+// Writes the encrypted stream block at the given offset (part of the iv header or content XOR keystream) to block
+static void encrypt_stream_block(PayloadStream* stream, int offset, uint8_t* block) {
+    if(offset < stream->iv_header_length) {
+        memcpy(block, stream->iv_header + offset, AES_BLOCK_SIZE);
+        return;
+    }
+
+    int content_offset = offset - stream->iv_header_length;
+    aes_ctr_block(&stream->aes, content_offset / AES_BLOCK_SIZE, block);
+    for(int i = 0; i < AES_BLOCK_SIZE && (size_t)(content_offset + i) < stream->content_length; i++) {
+        block[i] ^= stream->content[content_offset + i];
+    }
+}
+
+// Returns a pointer from which get_bits can read the stream byte (and the one after it)
+static inline uint8_t* embed_source(PayloadStream* stream, int byte) {
+    if(!stream->encrypted) {
+        return stream->content + byte;
+    }
+
+    if(byte + 1 >= stream->window_start + 2 * AES_BLOCK_SIZE) {
+        memcpy(stream->window, stream->window + AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+        stream->window_start += AES_BLOCK_SIZE;
+        encrypt_stream_block(stream, stream->window_start + AES_BLOCK_SIZE, stream->window + AES_BLOCK_SIZE);
+    }
+
+    return stream->window + (byte - stream->window_start);
+}
+
+static void init_metrics_accumulator(MetricsAccumulator* accumulator, EmbedMetrics* metrics, size_t pixel_count) {
+    memset(metrics, 0, sizeof(EmbedMetrics));
+    metrics->pixel_count = pixel_count;
+    accumulator->metrics = metrics;
+    accumulator->pending_pixels = 0;
+    #if defined(__SSE2__)
+    accumulator->partial_sums = _mm_setzero_si128();
+    #else
+    memset(accumulator->partial_sums, 0, sizeof(accumulator->partial_sums));
+    #endif
+}
+
+// Adds the partial sums to the 64-bit totals of the metrics
+static void flush_metrics_accumulator(MetricsAccumulator* accumulator) {
+    uint32_t partial_sums[4];
+    #if defined(__SSE2__)
+    _mm_storeu_si128((__m128i*)partial_sums, accumulator->partial_sums);
+    accumulator->partial_sums = _mm_setzero_si128();
+    #else
+    memcpy(partial_sums, accumulator->partial_sums, sizeof(partial_sums));
+    memset(accumulator->partial_sums, 0, sizeof(accumulator->partial_sums));
+    #endif
+
+    for(int c = 0; c < 4; c++) {
+        accumulator->metrics->squared_error[c] += partial_sums[c];
+    }
+    accumulator->pending_pixels = 0;
+}
+
+// Adds the distortion of one pixel, old_pixel holds the values before embedding
+static inline void accumulate_metrics(MetricsAccumulator* accumulator, Pixel* old_pixel, Pixel* new_pixel) {
+    #if defined(__SSE2__)
+    // A difference is at most 255, so its square fits into the 16-bit lane before widening to 32 bits
+    __m128i old_values = _mm_loadl_epi64((__m128i*)old_pixel);
+    __m128i new_values = _mm_loadl_epi64((__m128i*)new_pixel);
+    __m128i difference = _mm_sub_epi16(new_values, old_values);
+    __m128i square = _mm_mullo_epi16(difference, difference);
+    accumulator->partial_sums = _mm_add_epi32(accumulator->partial_sums, _mm_unpacklo_epi16(square, _mm_setzero_si128()));
+    accumulator->metrics->changed_pixels += _mm_movemask_epi8(_mm_cmpeq_epi16(old_values, new_values)) != 0xFFFF;
+    #else
+    uint16_t old_values[4] = { old_pixel->r, old_pixel->g, old_pixel->b, old_pixel->a };
+    uint16_t new_values[4] = { new_pixel->r, new_pixel->g, new_pixel->b, new_pixel->a };
+    uint16_t changed = 0;
+    for(int c = 0; c < 4; c++) {
+        int32_t difference = (int32_t)new_values[c] - old_values[c];
+        accumulator->partial_sums[c] += (uint32_t)(difference * difference);
+        changed |= new_values[c] ^ old_values[c];
+    }
+    accumulator->metrics->changed_pixels += changed != 0;
+    #endif
+
+    if(++accumulator->pending_pixels == METRICS_FLUSH_INTERVAL) {
+        flush_metrics_accumulator(accumulator);
+    }
+}
+
+// Also fills metrics (unless it is NULL) with the distortion caused by embedding
+// Returns 1 if the content is too large and 2 if no iv could be generated
+static int embed_content(ImageData img_data, uint8_t* content, size_t content_length, EmbedMetrics* metrics) {
+    PayloadStream stream;
+    init_payload_stream(&stream, content, content_length);
+    int max_size = determine_max_content(img_data, bit_number);
+    if(max_size <= 0 || (size_t)max_size < stream.stream_length) {
         return 1;
     }
 
+    if(stream.encrypted) {
+        if(aes_generate_iv(stream.iv_header)) {
+            return 2;
+        }
+        if(stream.settings.use_ecc) {
+            rs_encode(stream.iv_header, AES_BLOCK_SIZE, 1);
+        }
+        aes_init(&stream.aes, stream.settings.key, stream.iv_header);
+        encrypt_stream_block(&stream, 0, stream.window);
+        encrypt_stream_block(&stream, AES_BLOCK_SIZE, stream.window + AES_BLOCK_SIZE);
+    }
+
     uint8_t byte_mask = 0xFF << bit_number;
 
+    MetricsAccumulator accumulator;
+    if(metrics != NULL) {
+        init_metrics_accumulator(&accumulator, metrics, img_data.width * img_data.height);
+    }
+
     int content_byte = 0;
     int content_bit = 0;
-    for(int i = 0; (size_t)i < img_data.width * img_data.height && (size_t)content_byte < content_length; i++) {
+    for(int i = 0; (size_t)i < img_data.width * img_data.height && (size_t)content_byte < stream.stream_length; i++) {
         Pixel* pixel = img_data.buffer + i;
+        Pixel old_pixel = *pixel;
         
-        pixel->r = (pixel->r & byte_mask) | get_bits(content, content_byte, content_bit);
+        pixel->r = (pixel->r & byte_mask) | get_bits(embed_source(&stream, content_byte), 0, content_bit);
         content_byte += (content_bit + bit_number >= 8) ? 1 : 0;
         content_bit = (content_bit + bit_number) % 8;
         
-        pixel->g = (pixel->g & byte_mask) | get_bits(content, content_byte, content_bit);
+        pixel->g = (pixel->g & byte_mask) | get_bits(embed_source(&stream, content_byte), 0, content_bit);
         content_byte += (content_bit + bit_number >= 8) ? 1 : 0;
         content_bit = (content_bit + bit_number) % 8;
         
-        pixel->b = (pixel->b & byte_mask) | get_bits(content, content_byte, content_bit);
+        pixel->b = (pixel->b & byte_mask) | get_bits(embed_source(&stream, content_byte), 0, content_bit);
         content_byte += (content_bit + bit_number >= 8) ? 1 : 0;
         content_bit = (content_bit + bit_number) % 8;
         
         if(img_data.type == IMAGE_RGBA16 || img_data.type == IMAGE_RGBA32) {
-            pixel->a = (pixel->a & byte_mask) | get_bits(content, content_byte, content_bit);
+            pixel->a = (pixel->a & byte_mask) | get_bits(embed_source(&stream, content_byte), 0, content_bit);
             content_byte += (content_bit + bit_number >= 8) ? 1 : 0;
             content_bit = (content_bit + bit_number) % 8;
         }
+
+        if(metrics != NULL) {
+            accumulate_metrics(&accumulator, &old_pixel, pixel);
+        }
+    }
+
+    if(metrics != NULL) {
+        flush_metrics_accumulator(&accumulator);
     }
 
     return 0;
 }
 
+// Only used for 24-bit images, whose decoded channel values are the values written to the file
+static void print_embed_metrics(EmbedMetrics metrics) {
+    char* channel_names[3] = { "red", "green", "blue" };
+    double peak = 255.0; // Largest value of a channel
+
+    printf("Channel  MSE           PSNR (dB)\n");
+    for(int c = 0; c < 3; c++) {
+        double mse = metrics.pixel_count > 0 ? (double)metrics.squared_error[c] / metrics.pixel_count : 0.0;
+        if(mse == 0.0) {
+            printf("%-7s  %-12.6f  inf\n", channel_names[c], mse);
+        }
+        else {
+            printf("%-7s  %-12.6f  %.2f\n", channel_names[c], mse, 10.0 * log10(peak * peak / mse));
+        }
+    }
+
+    double changed_share = metrics.pixel_count > 0 ? 100.0 * metrics.changed_pixels / metrics.pixel_count : 0.0;
+    printf("Changed pixels: %llu of %llu (%.2f%%)\n", (unsigned long long)metrics.changed_pixels, (unsigned long long)metrics.pixel_count, changed_share);
+}
+
 // Adds the bits of data (amount of bits = bit_number) to the buffer at the specified bit index (expressed in byte and bit)
 // Data can only contain the important bits e.g. 0b00000101 and not 0b10101101 (for bit_number = 3)
 static inline void add_bits(uint8_t* buffer, int byte, int bit, uint8_t data) {
@@ -442,49 +952,131 @@ static inline void add_bits(uint8_t* buffer, int byte, int bit, uint8_t data) {
     }
 }
 
+// Decrypts a completed stream block at the given offset into the content (the first blocks are the iv header)
+static void decrypt_stream_block(PayloadStream* stream, int offset, uint8_t* block) {
+    if(offset < stream->iv_header_length) {
+        memcpy(stream->iv_header + offset, block, AES_BLOCK_SIZE);
+        if(offset + AES_BLOCK_SIZE == stream->iv_header_length) {
+            stream->iv_damaged = decode_iv_header(&stream->settings, stream->iv_header) != 0;
+            aes_init(&stream->aes, stream->settings.key, stream->iv_header);
+        }
+        return;
+    }
+
+    int content_offset = offset - stream->iv_header_length;
+    uint8_t keystream[AES_BLOCK_SIZE];
+    aes_ctr_block(&stream->aes, content_offset / AES_BLOCK_SIZE, keystream);
+    for(int i = 0; i < AES_BLOCK_SIZE && (size_t)(content_offset + i) < stream->content_length; i++) {
+        stream->content[content_offset + i] = block[i] ^ keystream[i];
+    }
+}
+
+// Returns a pointer to which add_bits can write the stream byte (and the one after it)
+static inline uint8_t* retrieve_target(PayloadStream* stream, int byte) {
+    if(!stream->encrypted) {
+        return stream->content + byte;
+    }
+
+    if(byte + 1 >= stream->window_start + 2 * AES_BLOCK_SIZE) {
+        decrypt_stream_block(stream, stream->window_start, stream->window);
+        memcpy(stream->window, stream->window + AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+        memset(stream->window + AES_BLOCK_SIZE, 0, AES_BLOCK_SIZE);
+        stream->window_start += AES_BLOCK_SIZE;
+    }
+
+    return stream->window + (byte - stream->window_start);
+}
+
 static uint8_t* retrieve_content(ImageData img_data, size_t* content_size) {
-    if(img_data.reserved > determine_max_content(img_data, bit_number)) {
+    PayloadSettings settings = payload_settings();
+    size_t content_length = embedded_content_length(&settings, (size_t)img_data.reserved);
+    int max_size = determine_max_content(img_data, bit_number);
+    if(max_size <= 0 || payload_stream_length(&settings, content_length) > (size_t)max_size) {
         return NULL;
     }
 
-    *content_size = (size_t)img_data.reserved;
+    *content_size = content_length;
     uint8_t* buffer = malloc(*content_size + 2); // Extra space to avoid segfault
-    memset(buffer, 0, *content_size);
+    memset(buffer, 0, *content_size + 2);
+
+    PayloadStream stream;
+    init_payload_stream(&stream, buffer, *content_size);
 
     uint8_t byte_mask = 0xFF << (8 - bit_number);
     byte_mask = byte_mask >> (8 - bit_number);
 
     int content_byte = 0;
     int content_bit = 0;
-    for(int i = 0; (size_t)i < img_data.width * img_data.height && (size_t)content_byte < *content_size; i++) {
+    for(int i = 0; (size_t)i < img_data.width * img_data.height && (size_t)content_byte < stream.stream_length; i++) {
         Pixel pixel = img_data.buffer[i];
         
         uint8_t r_data = pixel.r & byte_mask;
-        add_bits(buffer, content_byte, content_bit, r_data);
+        add_bits(retrieve_target(&stream, content_byte), 0, content_bit, r_data);
         content_byte += (content_bit + bit_number >= 8) ? 1 : 0;
         content_bit = (content_bit + bit_number) % 8;
 
         uint8_t g_data = pixel.g & byte_mask;
-        add_bits(buffer, content_byte, content_bit, g_data);
+        add_bits(retrieve_target(&stream, content_byte), 0, content_bit, g_data);
         content_byte += (content_bit + bit_number >= 8) ? 1 : 0;
         content_bit = (content_bit + bit_number) % 8;
         
         uint8_t b_data = pixel.b & byte_mask;
-        add_bits(buffer, content_byte, content_bit, b_data);
+        add_bits(retrieve_target(&stream, content_byte), 0, content_bit, b_data);
         content_byte += (content_bit + bit_number >= 8) ? 1 : 0;
         content_bit = (content_bit + bit_number) % 8;
         
         if(img_data.type == IMAGE_RGBA16 || img_data.type == IMAGE_RGBA32) {
             uint8_t a_data = pixel.a & byte_mask;
-            add_bits(buffer, content_byte, content_bit, a_data);
+            add_bits(retrieve_target(&stream, content_byte), 0, content_bit, a_data);
             content_byte += (content_bit + bit_number >= 8) ? 1 : 0;
             content_bit = (content_bit + bit_number) % 8;
         }
     }
 
+    if(stream.encrypted) {
+        // Decrypt the blocks remaining in the window
+        for(int offset = stream.window_start; (size_t)offset < stream.stream_length && offset < stream.window_start + 2 * AES_BLOCK_SIZE; offset += AES_BLOCK_SIZE) {
+            decrypt_stream_block(&stream, offset, stream.window + (offset - stream.window_start));
+        }
+    }
+
+    if(stream.iv_damaged) {
+        free(buffer);
+        return NULL;
+    }
+
     return buffer;
 }
 
+// Opens the image file and reads its header (see init_payload_reader)
+static int open_payload_reader(PayloadReader* reader, char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if(file == NULL) {
+        eprintf("Error: File '%s' could not be read\n", filename);
+        return 1;
+    }
+
+    ArchiveError error = init_payload_reader(reader, file, payload_settings());
+    if(error == ARCHIVE_ERROR_INVALID_IMAGE) {
+        eprintf("Error: %s\n", get_image_parser_error_message(reader->image_error));
+        return 1;
+    }
+    else if(error) {
+        eprintf("Error: %s\n", get_archive_error_message(error));
+        return 1;
+    }
+
+    return 0;
+}
+
+// Closes the reader and reports the bytes repaired while reading (only the read segments are corrected)
+static void finish_payload_reader(PayloadReader* reader) {
+    if(reader->corrected_count > 0) {
+        eprintf("Corrected %zu damaged bytes\n", reader->corrected_count);
+    }
+    close_payload_reader(reader);
+}
+
 #ifndef NDEBUG
 #define ASSERT(arg1, arg2) if(arg1 != arg2) { printf("Assertion failed at %s line %d, %hhu != %hhu\n", __FUNCTION__, __LINE__, arg1, arg2); }
 
@@ -530,11 +1122,424 @@ static void TEST_add_bits() {
 
 }
 
+static void TEST_aes() {
+    // FIPS-197 appendix C.1
+    uint8_t test_key[16] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+    uint8_t plain[16] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+    uint8_t expected[16] = { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+    uint8_t iv[16] = { 0 };
+    uint8_t cipher[16];
+
+    AesContext ctx;
+    aes_init(&ctx, test_key, iv);
+    aes_encrypt_block(&ctx, plain, cipher);
+    ASSERT(memcmp(cipher, expected, 16), 0);
+
+    ctx.use_aesni = false;
+    aes_encrypt_block(&ctx, plain, cipher);
+    ASSERT(memcmp(cipher, expected, 16), 0);
+
+    // The keystream at an offset has to match the one generated block by block
+    aes_init(&ctx, test_key, expected);
+    uint8_t stream[200] = { 0 };
+    aes_ctr_xor(&ctx, 5, stream + 5, sizeof(stream) - 5);
+    for(int block = 0; block < 12; block++) {
+        uint8_t keystream[16];
+        aes_ctr_block(&ctx, block, keystream);
+        ASSERT(memcmp(stream + block * 16 + 5 * (block == 0), keystream + 5 * (block == 0), 16 - 5 * (block == 0)), 0);
+    }
+}
+
+static void TEST_embed_encrypted() {
+    Pixel pixels[16 * 16] = { 0 };
+    ImageData img = { .type = IMAGE_RGB24, .height = 16, .width = 16, .buffer = pixels };
+
+    uint8_t content[100 + 4];
+    for(int i = 0; i < 100; i++) {
+        content[i] = (uint8_t)(i * 37 + 11);
+    }
+
+    bit_number = 3;
+    use_key = true;
+    for(int i = 0; i < AES_KEY_SIZE; i++) {
+        key[i] = (uint8_t)i;
+    }
+
+    img.reserved = 100;
+    ASSERT(embed_content(img, content, 100, NULL), 0);
+
+    size_t content_size;
+    uint8_t* retrieved = retrieve_content(img, &content_size);
+    ASSERT((int)content_size, 100);
+    ASSERT(memcmp(retrieved, content, 100), 0);
+    free(retrieved);
+
+    // With error correction a damaged iv is corrected as well
+    use_ecc = true;
+    uint8_t encoded[100 + RS_PARITY_SIZE + 4];
+    memcpy(encoded, content, 100);
+    rs_encode(encoded, 100, 1);
+    ASSERT(embed_content(img, encoded, 100 + RS_PARITY_SIZE, NULL), 0);
+
+    pixels[0].r ^= 0x01; // First bit of the iv
+    pixels[5].g ^= 0x04;
+    retrieved = retrieve_content(img, &content_size);
+    ASSERT((retrieved != NULL), 1);
+    ASSERT((int)rs_decode(retrieved, 100, 1, &content_size), 0);
+    ASSERT(memcmp(retrieved, content, 100), 0);
+    free(retrieved);
+
+    // 17 damaged bytes in the iv header can not be corrected (channel (8 * k + 2) / 3 holds bits of byte k)
+    for(int k = 0; k < 17; k++) {
+        int channel = (8 * k + 2) / 3;
+        Pixel* pixel = pixels + channel / 3;
+        if(channel % 3 == 0) pixel->r ^= 0x02;
+        else if(channel % 3 == 1) pixel->g ^= 0x02;
+        else pixel->b ^= 0x02;
+    }
+    retrieved = retrieve_content(img, &content_size);
+    ASSERT((retrieved == NULL), 1);
+    free(retrieved);
+
+    use_ecc = false;
+    use_key = false;
+}
+
+static void TEST_read_stream() {
+    Pixel pixels[8 * 8] = { 0 };
+    ImageData img = { .type = IMAGE_RGBA32, .height = 8, .width = 8, .buffer = pixels };
+
+    uint8_t content[40 + 4];
+    for(int i = 0; i < 40; i++) {
+        content[i] = (uint8_t)(i * 73 + 5);
+    }
+
+    bit_number = 3;
+    img.reserved = 40;
+    ASSERT(embed_content(img, content, 40, NULL), 0);
+
+    uint8_t buffer[40];
+    read_stream(img, bit_number, 0, 0, 40, buffer);
+    ASSERT(memcmp(buffer, content, 40), 0);
+
+    // Starting in the middle of a pixel with pixels missing at the front
+    read_stream(img, bit_number, 0, 7, 13, buffer);
+    ASSERT(memcmp(buffer, content + 7, 13), 0);
+
+    ImageData rows = img;
+    rows.buffer = pixels + 2 * 8;
+    rows.height = 6;
+    read_stream(rows, bit_number, 2 * 8, 25, 15, buffer);
+    ASSERT(memcmp(buffer, content + 25, 15), 0);
+}
+
+static void TEST_reed_solomon() {
+    uint8_t data[1000 + 5 * RS_PARITY_SIZE];
+    uint8_t original[1000];
+    for(int i = 0; i < 1000; i++) {
+        original[i] = data[i] = (uint8_t)(i * 29 + 3);
+    }
+
+    RsImplementation implementations[] = { RS_IMPLEMENTATION_SCALAR, RS_IMPLEMENTATION_SSSE3, RS_IMPLEMENTATION_AVX2 };
+    for(int i = 0; i < 3; i++) {
+        rs_select_implementation(implementations[i]);
+        ASSERT((int)rs_encoded_length(1000), 1000 + 5 * RS_PARITY_SIZE);
+        rs_encode(data, 1000, 2);
+
+        // 16 errors in code word 0 (every fifth byte), some in code word 3 and in the parity
+        for(int j = 0; j < 16; j++) {
+            data[j * 5 * 5] ^= 0xA5;
+        }
+        data[3] ^= 0x01;
+        data[3 + 5 * 100] ^= 0xFF;
+        data[1000 + 7] ^= 0x10;
+
+        size_t corrected_count;
+        ASSERT((int)rs_decode(data, 1000, 2, &corrected_count), 0);
+        ASSERT((int)corrected_count, 19);
+        ASSERT(memcmp(data, original, 1000), 0);
+
+        // 17 errors can not be corrected
+        for(int j = 0; j < 17; j++) {
+            data[j * 5 * 5] ^= 0x5A;
+        }
+        ASSERT((int)rs_decode(data, 1000, 1, &corrected_count), 1);
+        for(int j = 0; j < 17; j++) {
+            data[j * 5 * 5] ^= 0x5A;
+        }
+
+        // Segments are encoded one after the other, the data of segment 1 starts at RS_SEGMENT_SIZE
+        size_t segment_length = 2 * RS_SEGMENT_DATA_SIZE + 500;
+        uint8_t* segment_data = malloc(rs_encoded_length(segment_length));
+        for(size_t j = 0; j < segment_length; j++) {
+            segment_data[j] = (uint8_t)(j * 13 + 7);
+        }
+        rs_encode(segment_data, segment_length, 2);
+        ASSERT((int)rs_encoded_length(segment_length), 2 * RS_SEGMENT_SIZE + 500 + 3 * RS_PARITY_SIZE);
+        ASSERT(segment_data[RS_SEGMENT_SIZE + 100], (uint8_t)((RS_SEGMENT_DATA_SIZE + 100) * 13 + 7));
+        ASSERT(segment_data[2 * RS_SEGMENT_SIZE + 499], (uint8_t)((2 * RS_SEGMENT_DATA_SIZE + 499) * 13 + 7));
+
+        // Damage in segment 1 only, the decoded data is moved back together
+        for(int j = 0; j < 10; j++) {
+            segment_data[RS_SEGMENT_SIZE + j * 1000] ^= 0x33;
+        }
+        ASSERT((int)rs_decode(segment_data, segment_length, 2, &corrected_count), 0);
+        ASSERT((int)corrected_count, 10);
+        int segment_errors = 0;
+        for(size_t j = 0; j < segment_length; j++) {
+            if(segment_data[j] != (uint8_t)(j * 13 + 7)) segment_errors++;
+        }
+        ASSERT(segment_errors, 0);
+        free(segment_data);
+    }
+
+    rs_select_implementation(RS_IMPLEMENTATION_AUTO);
+    ASSERT((int)rs_max_data_length(rs_encoded_length(1000)), 1000);
+}
+
+static void TEST_embed_metrics() {
+    Pixel pixels[4 * 4] = { 0 };
+    ImageData img = { .type = IMAGE_RGB24, .height = 4, .width = 4, .buffer = pixels };
+    uint8_t content[6 + 4];
+    memset(content, 0xFF, sizeof(content));
+
+    // Every channel of every pixel changes from 0 to 1
+    bit_number = 1;
+    EmbedMetrics metrics;
+    ASSERT(embed_content(img, content, 6, &metrics), 0);
+    ASSERT((int)metrics.squared_error[0], 16);
+    ASSERT((int)metrics.squared_error[2], 16);
+    ASSERT((int)metrics.squared_error[3], 0);
+    ASSERT((int)metrics.changed_pixels, 16);
+    ASSERT((int)metrics.pixel_count, 16);
+
+    // Embedding the same content again changes nothing
+    ASSERT(embed_content(img, content, 6, &metrics), 0);
+    ASSERT((int)metrics.squared_error[1], 0);
+    ASSERT((int)metrics.changed_pixels, 0);
+
+    // More pixels than are added to the partial sums before a flush
+    size_t pixel_count = METRICS_FLUSH_INTERVAL + 1000;
+    ImageData large = { .type = IMAGE_RGB24, .height = pixel_count / 8, .width = 8 };
+    large.buffer = malloc(sizeof(Pixel) * pixel_count);
+    for(size_t i = 0; i < pixel_count; i++) {
+        large.buffer[i] = (Pixel){ 0xF0, 0x0F, 0x00, 0x00 };
+    }
+    uint8_t* large_content = malloc(pixel_count * 3 / 2 + 4);
+    memset(large_content, 0xFF, pixel_count * 3 / 2);
+
+    // Red and blue change by 15, green keeps its value
+    bit_number = 4;
+    ASSERT(embed_content(large, large_content, pixel_count * 3 / 2, &metrics), 0);
+    ASSERT((metrics.squared_error[0] == 225 * pixel_count), 1);
+    ASSERT((metrics.squared_error[1] == 0), 1);
+    ASSERT((metrics.squared_error[2] == 225 * pixel_count), 1);
+    ASSERT((metrics.changed_pixels == pixel_count), 1);
+
+    free(large_content);
+    free(large.buffer);
+}
+
+// Opens a reader on the image file of img
+static int open_image_reader(ImageData img, PayloadReader* reader) {
+    size_t file_length;
+    uint8_t* file_data = create_image_file(img, &file_length);
+    FILE* file = tmpfile();
+    if(file == NULL) {
+        free(file_data);
+        return 1;
+    }
+    fwrite(file_data, 1, file_length, file);
+    rewind(file);
+    free(file_data);
+
+    return init_payload_reader(reader, file, payload_settings());
+}
+
+// Embeds content into img and opens a reader on the resulting image file
+static int open_test_reader(ImageData img, uint8_t* content, size_t content_length, PayloadReader* reader) {
+    if(embed_content(img, content, content_length, NULL)) {
+        return 1;
+    }
+    return open_image_reader(img, reader);
+}
+
+static void TEST_archive() {
+    uint8_t first[100];
+    uint8_t second[3000];
+    for(int i = 0; i < 3000; i++) {
+        if(i < 100) first[i] = (uint8_t)(i * 7 + 1);
+        second[i] = (uint8_t)(i * 13 + 5);
+    }
+
+    char* names[3] = { "a.txt", "b.bin", "empty" };
+    uint8_t* contents[3] = { first, second, first };
+    size_t lengths[3] = { 100, 3000, 0 };
+
+    ArchiveError error;
+    int failed_entry;
+    size_t archive_length;
+    uint8_t* archive_data = pack_archive(names, contents, lengths, 3, &archive_length, &error, &failed_entry);
+    ASSERT(error, ARCHIVE_ERROR_NO_ERROR);
+    ASSERT((archive_length == ARCHIVE_HEADER_SIZE + 3 * sizeof(ArchiveEntry) + 3100), 1);
+
+    // Every name may only be used once
+    size_t unused_length;
+    names[2] = "a.txt";
+    ASSERT((pack_archive(names, contents, lengths, 3, &unused_length, &error, &failed_entry) == NULL), 1);
+    ASSERT(error, ARCHIVE_ERROR_DUPLICATE_NAME);
+    ASSERT(failed_entry, 2);
+    names[2] = "";
+    ASSERT((pack_archive(names, contents, lengths, 3, &unused_length, &error, &failed_entry) == NULL), 1);
+    ASSERT(error, ARCHIVE_ERROR_INVALID_NAME);
+
+    // A width of 32 pixels gives rows of 96 bytes, which need no padding
+    Pixel* pixels = calloc(32 * 150, sizeof(Pixel));
+    ImageData img = { .type = IMAGE_RGB24, .height = 150, .width = 32, .buffer = pixels, .reserved = (int32_t)archive_length };
+    bit_number = 2;
+
+    for(int encrypted = 0; encrypted < 2; encrypted++) {
+        use_key = encrypted;
+        PayloadReader reader;
+        ASSERT(open_test_reader(img, archive_data, archive_length, &reader), 0);
+        ASSERT((int)reader.header.row_length, 96);
+
+        uint32_t entry_count;
+        ArchiveEntry* entries = read_archive_index(&reader, &entry_count, &error);
+        ASSERT(error, ARCHIVE_ERROR_NO_ERROR);
+        if(entries == NULL) {
+            close_payload_reader(&reader);
+            continue;
+        }
+        ASSERT((int)entry_count, 3);
+        ASSERT((find_archive_entry(entries, entry_count, "c") == NULL), 1);
+
+        ArchiveEntry* entry = find_archive_entry(entries, entry_count, "b.bin");
+        ASSERT((entry != NULL && entry->length == 3000), 1);
+
+        // A range in the middle of the second file spans several rows
+        uint8_t buffer[3000];
+        size_t offset = entry != NULL ? entry->offset : 0;
+        ASSERT(read_payload(&reader, offset + 1234, 1000, buffer), 0);
+        ASSERT(memcmp(buffer, second + 1234, 1000), 0);
+
+        // The last byte of the archive is in the last row used
+        ASSERT(read_payload(&reader, archive_length - 1, 1, buffer), 0);
+        ASSERT(buffer[0], second[2999]);
+
+        free(entries);
+        close_payload_reader(&reader);
+    }
+    use_key = false;
+
+    // Wrong magic number
+    PayloadReader reader;
+    uint32_t entry_count;
+    archive_data[0] = 'X';
+    ASSERT(open_test_reader(img, archive_data, archive_length, &reader), 0);
+    ASSERT((read_archive_index(&reader, &entry_count, &error) == NULL), 1);
+    ASSERT(error, ARCHIVE_ERROR_NO_ARCHIVE);
+    close_payload_reader(&reader);
+    archive_data[0] = 'B';
+
+    // More entries than fit into the archive
+    *(uint32_t*)(archive_data + 4) = 100;
+    ASSERT(open_test_reader(img, archive_data, archive_length, &reader), 0);
+    ASSERT((read_archive_index(&reader, &entry_count, &error) == NULL), 1);
+    ASSERT(error, ARCHIVE_ERROR_CORRUPT_INDEX);
+    close_payload_reader(&reader);
+    *(uint32_t*)(archive_data + 4) = 3;
+
+    // An entry reaching past the end of the archive
+    ((ArchiveEntry*)(archive_data + ARCHIVE_HEADER_SIZE))[1].length = 3001;
+    ASSERT(open_test_reader(img, archive_data, archive_length, &reader), 0);
+    ASSERT((read_archive_index(&reader, &entry_count, &error) == NULL), 1);
+    ASSERT(error, ARCHIVE_ERROR_CORRUPT_INDEX);
+    close_payload_reader(&reader);
+
+    free(pixels);
+    free(archive_data);
+
+    // With error correction only the segments covering the read bytes are decoded
+    uint8_t* large = malloc(40000);
+    for(int i = 0; i < 40000; i++) {
+        large[i] = (uint8_t)(i * 11 + 3);
+    }
+    contents[1] = large;
+    lengths[1] = 40000;
+    names[2] = "empty";
+    archive_data = pack_archive(names, contents, lengths, 3, &archive_length, &error, &failed_entry);
+    size_t encoded_length = rs_encoded_length(archive_length);
+    ASSERT((archive_length > 2 * RS_SEGMENT_DATA_SIZE), 1);
+
+    pixels = malloc(sizeof(Pixel) * 32 * 2000);
+    img = (ImageData){ .type = IMAGE_RGB24, .height = 2000, .width = 32, .buffer = pixels, .reserved = (int32_t)archive_length };
+    use_ecc = true;
+    uint8_t* encoded = malloc(encoded_length + 1);
+
+    for(int encrypted = 0; encrypted < 2; encrypted++) {
+        use_key = encrypted;
+        memset(pixels, 0, sizeof(Pixel) * 32 * 2000);
+        memcpy(encoded, archive_data, archive_length);
+        rs_encode(encoded, archive_length, 1);
+        ASSERT(embed_content(img, encoded, encoded_length, NULL), 0);
+
+        // Byte k of the stream is in channels 4k to 4k + 3 (3 channels per pixel, 2 bits each)
+        PayloadSettings settings = payload_settings();
+        size_t iv_length = iv_header_length(&settings);
+        for(int i = 0; i < 5; i++) {
+            pixels[(iv_length + RS_SEGMENT_SIZE + 1000 + i * 2000) * 4 / 3].r ^= 0x01;
+        }
+        for(size_t i = (iv_length + 2 * RS_SEGMENT_SIZE) * 4 / 3 + 3; i < 32 * 2000; i++) {
+            pixels[i].g ^= 0x03;
+        }
+
+        ASSERT(open_image_reader(img, &reader), 0);
+        ArchiveEntry* entries = read_archive_index(&reader, &entry_count, &error);
+        ASSERT(error, ARCHIVE_ERROR_NO_ERROR);
+        if(entries == NULL) {
+            close_payload_reader(&reader);
+            continue;
+        }
+        ASSERT((int)entry_count, 3);
+
+        uint8_t buffer[4000];
+        ASSERT(read_payload(&reader, entries[0].offset, 100, buffer), 0);
+        ASSERT(memcmp(buffer, first, 100), 0);
+        ASSERT((int)reader.corrected_count, 0);
+
+        // The damage in segment 1 is only corrected once it is read
+        size_t offset = RS_SEGMENT_DATA_SIZE - 1000;
+        ASSERT(read_payload(&reader, offset, 4000, buffer), 0);
+        ASSERT(memcmp(buffer, large + offset - entries[1].offset, 4000), 0);
+        ASSERT((int)reader.corrected_count, 5);
+
+        // The last segment is destroyed
+        ASSERT(read_payload(&reader, archive_length - 10, 10, buffer), ARCHIVE_ERROR_TOO_DAMAGED);
+
+        free(entries);
+        close_payload_reader(&reader);
+    }
+    use_key = false;
+    use_ecc = false;
+
+    free(encoded);
+    free(pixels);
+    free(large);
+    free(archive_data);
+}
+
 static void run_tests() {
     int initial_bit_number = bit_number;
 
     TEST_add_bits();
     TEST_get_bits();
+    TEST_aes();
+    TEST_embed_encrypted();
+    TEST_read_stream();
+    TEST_reed_solomon();
+    TEST_embed_metrics();
+    TEST_archive();
     
     printf("TESTS RAN\n");
 
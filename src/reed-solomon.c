@@ -0,0 +1,582 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "reed-solomon.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RS_SIMD_AVAILABLE
+#include <immintrin.h>
+#endif
+
+#define RS_MAX_KERNEL_WIDTH 64 // Number of code words the widest kernel works on at once
+
+#if RS_SEGMENT_CODEWORDS % RS_MAX_KERNEL_WIDTH != 0
+#error "A segment has to consist of whole kernel chunks"
+#endif
+
+// Layout of a segment (see RS_SEGMENT_SIZE):
+// The data of the segment is split column wise into codeword_count code words, byte m of the data is symbol
+// m / codeword_count of code word m % codeword_count (missing symbols at the end are treated as 0). The parity
+// symbol p of all code words follows as row p after the data. This interleaves the code words, so the data stays
+// unchanged and row j of all code words is contiguous in memory, which is what the SIMD kernels work on.
+typedef struct RsLayout {
+    uint8_t* buffer;
+    size_t data_length;
+    size_t codeword_count;
+} RsLayout;
+
+// Multiplication by a constant c is done with two 16 entry tables, c * x = low[x & 0x0F] ^ high[x >> 4]
+// The AVX2 kernel broadcasts each table into both halves of a register
+typedef struct MulTable {
+    uint8_t low[16];
+    uint8_t high[16];
+} MulTable;
+
+// Computes the parity of count code words starting at code word first
+typedef void (*ParityKernel)(RsLayout* layout, size_t first, int count, uint8_t parity[RS_PARITY_SIZE][RS_MAX_KERNEL_WIDTH]);
+
+typedef struct RsTask {
+    uint8_t* buffer; // Encoded data
+    size_t data_length;
+    size_t first; // First segment of the task
+    size_t last; // One past the last segment of the task
+    bool decode;
+    size_t corrected_count;
+    size_t failed_count;
+} RsTask;
+
+static uint8_t gf_exp[2 * 255];
+static uint8_t gf_log[256];
+static MulTable generator_tables[RS_PARITY_SIZE]; // Coefficients of the generator polynomial (without the leading 1)
+static MulTable parity_matrix[RS_DATA_SIZE][RS_PARITY_SIZE]; // Parity symbol p is the sum of data symbol j times entry [j][p]
+static bool initialized = false;
+
+static ParityKernel parity_kernel;
+static int kernel_width;
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if(a == 0 || b == 0) return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline uint8_t gf_div(uint8_t a, uint8_t b) {
+    if(a == 0) return 0;
+    return gf_exp[gf_log[a] + 255 - gf_log[b]];
+}
+
+static void fill_mul_table(MulTable* table, uint8_t c) {
+    for(int i = 0; i < 16; i++) {
+        table->low[i] = gf_mul(c, i);
+        table->high[i] = gf_mul(c, i << 4);
+    }
+}
+
+static void init_tables() {
+    // GF(256) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 and alpha = 2
+    uint16_t x = 1;
+    for(int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if(x & 0x100) x ^= 0x11D;
+    }
+
+    // g(x) = (x - alpha^0)(x - alpha^1)...(x - alpha^31), coefficients from the lowest power
+    uint8_t generator[RS_PARITY_SIZE + 1] = { 1 };
+    for(int i = 0; i < RS_PARITY_SIZE; i++) {
+        for(int j = i + 1; j > 0; j--) {
+            generator[j] = generator[j - 1] ^ gf_mul(generator[j], gf_exp[i]);
+        }
+        generator[0] = gf_mul(generator[0], gf_exp[i]);
+    }
+
+    for(int i = 0; i < RS_PARITY_SIZE; i++) {
+        fill_mul_table(generator_tables + i, generator[i]);
+    }
+
+    // Data symbol j is the coefficient of x^(254 - j), its parity is the remainder of x^(254 - j) divided by g(x)
+    // Starting with x^32 mod g(x) = g(x) - x^32, every previous symbol multiplies the remainder by x
+    uint8_t remainder[RS_PARITY_SIZE];
+    memcpy(remainder, generator, RS_PARITY_SIZE);
+    for(int j = RS_DATA_SIZE - 1; j >= 0; j--) {
+        for(int p = 0; p < RS_PARITY_SIZE; p++) {
+            fill_mul_table(&parity_matrix[j][p], remainder[RS_PARITY_SIZE - 1 - p]); // Parity symbol p is the coefficient of x^(31 - p)
+        }
+
+        uint8_t carry = remainder[RS_PARITY_SIZE - 1];
+        for(int i = RS_PARITY_SIZE - 1; i > 0; i--) {
+            remainder[i] = remainder[i - 1] ^ gf_mul(carry, generator[i]);
+        }
+        remainder[0] = gf_mul(carry, generator[0]);
+    }
+}
+
+// Returns a pointer to width bytes of row j starting at code word first
+// Rows which are incomplete (at the end of the data or the last code words) are copied into temp and padded with 0
+static inline uint8_t* load_row(RsLayout* layout, int j, size_t first, int count, int width, uint8_t* temp) {
+    size_t start;
+    size_t end;
+    if(j < RS_DATA_SIZE) {
+        start = j * layout->codeword_count + first;
+        end = layout->data_length;
+    }
+    else {
+        start = layout->data_length + (j - RS_DATA_SIZE) * layout->codeword_count + first;
+        end = layout->data_length + RS_PARITY_SIZE * layout->codeword_count;
+    }
+
+    if(count == width && start + width <= end) {
+        return layout->buffer + start;
+    }
+
+    memset(temp, 0, width);
+    if(start < end) {
+        memcpy(temp, layout->buffer + start, end - start < (size_t)count ? end - start : (size_t)count);
+    }
+    return temp;
+}
+
+// Returns a pointer to the data rows of width code words starting at code word first, row j starts at j * *stride
+// If any row is incomplete all of them are copied into temp (RS_DATA_SIZE rows of width bytes) and padded with 0
+static uint8_t* load_data_rows(RsLayout* layout, size_t first, int count, int width, uint8_t* temp, size_t* stride) {
+    size_t last_row_end = (RS_DATA_SIZE - 1) * layout->codeword_count + first + width;
+    if(count == width && last_row_end <= layout->data_length) {
+        *stride = layout->codeword_count;
+        return layout->buffer + first;
+    }
+
+    for(int j = 0; j < RS_DATA_SIZE; j++) {
+        uint8_t* row = load_row(layout, j, first, count, width, temp + j * width);
+        if(row != temp + j * width) {
+            memcpy(temp + j * width, row, width);
+        }
+    }
+    *stride = width;
+    return temp;
+}
+
+static inline uint8_t* parity_row(RsLayout* layout, int p, size_t first) {
+    return layout->buffer + layout->data_length + p * layout->codeword_count + first;
+}
+
+// The kernels compute the parity for many code words at once, one code word per byte lane
+
+// Portable kernel, works on 16 code words at once like the SSSE3 kernel
+// A linear feedback shift register runs over the data symbols (highest power first) and holds the remainder
+// of the division by the generator polynomial
+static void parity_chunk_scalar(RsLayout* layout, size_t first, int count, uint8_t parity[RS_PARITY_SIZE][RS_MAX_KERNEL_WIDTH]) {
+    uint8_t registers[RS_PARITY_SIZE][16] = { { 0 } };
+    uint8_t temp[16];
+
+    for(int j = 0; j < RS_DATA_SIZE; j++) {
+        uint8_t* data = load_row(layout, j, first, count, 16, temp);
+
+        uint8_t feedback[16];
+        for(int l = 0; l < 16; l++) {
+            feedback[l] = data[l] ^ registers[RS_PARITY_SIZE - 1][l];
+        }
+        for(int i = RS_PARITY_SIZE - 1; i >= 0; i--) {
+            MulTable* table = generator_tables + i;
+            for(int l = 0; l < 16; l++) {
+                uint8_t product = table->low[feedback[l] & 0x0F] ^ table->high[feedback[l] >> 4];
+                registers[i][l] = (i > 0 ? registers[i - 1][l] : 0) ^ product;
+            }
+        }
+    }
+
+    for(int p = 0; p < RS_PARITY_SIZE; p++) {
+        memcpy(parity[p], registers[RS_PARITY_SIZE - 1 - p], 16);
+    }
+}
+
+#ifdef RS_SIMD_AVAILABLE
+// Multiplies the data rows with the parity matrix instead of running the shift register, so the parity symbols
+// do not depend on each other and can be computed in blocks whose sums fit into the 16 vector registers
+// A block of 8 parity symbols needs 8 sums, the split data, 2 tables and the mask
+#define SIMD_PARITY_BLOCK 8
+
+__attribute__((target("ssse3")))
+static void parity_chunk_ssse3(RsLayout* layout, size_t first, int count, uint8_t parity[RS_PARITY_SIZE][RS_MAX_KERNEL_WIDTH]) {
+    __m128i mask = _mm_set1_epi8(0x0F);
+    uint8_t temp[RS_DATA_SIZE * 16];
+    size_t stride;
+    uint8_t* rows = load_data_rows(layout, first, count, 16, temp, &stride);
+
+    for(int block = 0; block < RS_PARITY_SIZE; block += SIMD_PARITY_BLOCK) {
+        __m128i sums[SIMD_PARITY_BLOCK];
+        for(int p = 0; p < SIMD_PARITY_BLOCK; p++) {
+            sums[p] = _mm_setzero_si128();
+        }
+
+        for(int j = 0; j < RS_DATA_SIZE; j++) {
+            __m128i data = _mm_loadu_si128((__m128i*)(rows + j * stride));
+            __m128i low = _mm_and_si128(data, mask);
+            __m128i high = _mm_and_si128(_mm_srli_epi16(data, 4), mask);
+
+            #pragma GCC unroll 8
+            for(int p = 0; p < SIMD_PARITY_BLOCK; p++) {
+                MulTable* table = &parity_matrix[j][block + p];
+                __m128i product_low = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)table->low), low);
+                __m128i product_high = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)table->high), high);
+                sums[p] = _mm_xor_si128(sums[p], _mm_xor_si128(product_low, product_high));
+            }
+        }
+
+        for(int p = 0; p < SIMD_PARITY_BLOCK; p++) {
+            _mm_storeu_si128((__m128i*)parity[block + p], sums[p]);
+        }
+    }
+}
+
+// Same as the SSSE3 kernel with 32 code words per register, the two halves of the 64 code words are done one
+// after the other so the sums still fit into the 16 registers
+__attribute__((target("avx2")))
+static void parity_chunk_avx2(RsLayout* layout, size_t first, int count, uint8_t parity[RS_PARITY_SIZE][RS_MAX_KERNEL_WIDTH]) {
+    __m256i mask = _mm256_set1_epi8(0x0F);
+    uint8_t temp[RS_DATA_SIZE * 64];
+    size_t stride;
+    uint8_t* rows = load_data_rows(layout, first, count, 64, temp, &stride);
+
+    for(int half = 0; half < 64; half += 32) {
+        for(int block = 0; block < RS_PARITY_SIZE; block += SIMD_PARITY_BLOCK) {
+            __m256i sums[SIMD_PARITY_BLOCK];
+            for(int p = 0; p < SIMD_PARITY_BLOCK; p++) {
+                sums[p] = _mm256_setzero_si256();
+            }
+
+            for(int j = 0; j < RS_DATA_SIZE; j++) {
+                __m256i data = _mm256_loadu_si256((__m256i*)(rows + j * stride + half));
+                __m256i low = _mm256_and_si256(data, mask);
+                __m256i high = _mm256_and_si256(_mm256_srli_epi16(data, 4), mask);
+
+                #pragma GCC unroll 8
+                for(int p = 0; p < SIMD_PARITY_BLOCK; p++) {
+                    MulTable* table = &parity_matrix[j][block + p];
+                    __m256i table_low = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)table->low));
+                    __m256i table_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)table->high));
+                    sums[p] = _mm256_xor_si256(sums[p], _mm256_xor_si256(_mm256_shuffle_epi8(table_low, low), _mm256_shuffle_epi8(table_high, high)));
+                }
+            }
+
+            for(int p = 0; p < SIMD_PARITY_BLOCK; p++) {
+                _mm256_storeu_si256((__m256i*)(parity[block + p] + half), sums[p]);
+            }
+        }
+    }
+}
+#endif
+
+void rs_select_implementation(RsImplementation implementation) {
+    if(!initialized) {
+        init_tables();
+        initialized = true;
+    }
+
+    #ifdef RS_SIMD_AVAILABLE
+    bool has_avx2 = __builtin_cpu_supports("avx2");
+    bool has_ssse3 = __builtin_cpu_supports("ssse3");
+    #else
+    bool has_avx2 = false;
+    bool has_ssse3 = false;
+    #endif
+
+    if(implementation == RS_IMPLEMENTATION_AUTO) {
+        implementation = RS_IMPLEMENTATION_AVX2;
+    }
+    if(implementation == RS_IMPLEMENTATION_AVX2 && !has_avx2) {
+        implementation = RS_IMPLEMENTATION_SSSE3;
+    }
+    if(implementation == RS_IMPLEMENTATION_SSSE3 && !has_ssse3) {
+        implementation = RS_IMPLEMENTATION_SCALAR;
+    }
+
+    parity_kernel = parity_chunk_scalar;
+    kernel_width = 16;
+
+    #ifdef RS_SIMD_AVAILABLE
+    if(implementation == RS_IMPLEMENTATION_AVX2) {
+        parity_kernel = parity_chunk_avx2;
+        kernel_width = 64;
+    }
+    else if(implementation == RS_IMPLEMENTATION_SSSE3) {
+        parity_kernel = parity_chunk_ssse3;
+    }
+    #endif
+}
+
+// Only the last segment can have incomplete code words, so the parity is the same as without segments
+size_t rs_encoded_length(size_t data_length) {
+    size_t codeword_count = (data_length + RS_DATA_SIZE - 1) / RS_DATA_SIZE;
+    return data_length + RS_PARITY_SIZE * codeword_count;
+}
+
+// Largest data length whose encoded length fits into encoded_length
+size_t rs_max_data_length(size_t encoded_length) {
+    size_t full_codewords = encoded_length / RS_BLOCK_SIZE;
+    size_t remainder = encoded_length % RS_BLOCK_SIZE;
+    return full_codewords * RS_DATA_SIZE + (remainder > RS_PARITY_SIZE ? remainder - RS_PARITY_SIZE : 0);
+}
+
+static inline uint8_t get_symbol(RsLayout* layout, size_t codeword, int j) {
+    if(j >= RS_DATA_SIZE) {
+        return *parity_row(layout, j - RS_DATA_SIZE, codeword);
+    }
+
+    size_t index = j * layout->codeword_count + codeword;
+    return index < layout->data_length ? layout->buffer[index] : 0;
+}
+
+// Corrects a single code word with the Berlekamp-Massey algorithm, Chien search and the Forney algorithm
+// Only called for code words whose stored parity does not match, so this does not need to be vectorised
+// Returns the number of corrected symbols or -1 if the code word can not be corrected
+static int correct_codeword(RsLayout* layout, size_t codeword) {
+    // Syndrome i is the received polynomial evaluated at alpha^i
+    uint8_t syndromes[RS_PARITY_SIZE] = { 0 };
+    for(int j = 0; j < RS_BLOCK_SIZE; j++) {
+        uint8_t symbol = get_symbol(layout, codeword, j);
+        for(int i = 0; i < RS_PARITY_SIZE; i++) {
+            syndromes[i] = gf_mul(syndromes[i], gf_exp[i]) ^ symbol;
+        }
+    }
+
+    // Error locator polynomial lambda
+    uint8_t lambda[RS_PARITY_SIZE + 1] = { 1 };
+    uint8_t previous[RS_PARITY_SIZE + 1] = { 1 };
+    int errors = 0;
+    int shift = 1;
+    uint8_t previous_discrepancy = 1;
+
+    for(int n = 0; n < RS_PARITY_SIZE; n++) {
+        uint8_t discrepancy = syndromes[n];
+        for(int i = 1; i <= errors; i++) {
+            discrepancy ^= gf_mul(lambda[i], syndromes[n - i]);
+        }
+
+        if(discrepancy == 0) {
+            shift++;
+            continue;
+        }
+
+        uint8_t factor = gf_div(discrepancy, previous_discrepancy);
+        uint8_t old_lambda[RS_PARITY_SIZE + 1];
+        memcpy(old_lambda, lambda, sizeof(lambda));
+        for(int i = 0; i + shift <= RS_PARITY_SIZE; i++) {
+            lambda[i + shift] ^= gf_mul(factor, previous[i]);
+        }
+
+        if(2 * errors <= n) {
+            errors = n + 1 - errors;
+            memcpy(previous, old_lambda, sizeof(previous));
+            previous_discrepancy = discrepancy;
+            shift = 1;
+        }
+        else {
+            shift++;
+        }
+    }
+
+    if(errors > RS_PARITY_SIZE / 2) {
+        return -1;
+    }
+
+    // Error evaluator polynomial omega = syndromes * lambda mod x^32
+    uint8_t omega[RS_PARITY_SIZE] = { 0 };
+    for(int i = 0; i < RS_PARITY_SIZE; i++) {
+        for(int j = 0; j <= i && j <= errors; j++) {
+            omega[i] ^= gf_mul(syndromes[i - j], lambda[j]);
+        }
+    }
+
+    // Symbol j of the code word is the coefficient of x^(254 - j)
+    int positions[RS_PARITY_SIZE / 2];
+    uint8_t values[RS_PARITY_SIZE / 2];
+    int found = 0;
+    for(int power = 0; power < RS_BLOCK_SIZE; power++) {
+        int inverse = (255 - power) % 255; // log of X^-1
+        uint8_t sum = 0;
+        for(int i = 0; i <= errors; i++) {
+            sum ^= gf_mul(lambda[i], gf_exp[(inverse * i) % 255]);
+        }
+        if(sum != 0) continue;
+
+        if(found == errors) {
+            return -1;
+        }
+
+        uint8_t omega_value = 0;
+        for(int i = 0; i < RS_PARITY_SIZE; i++) {
+            omega_value ^= gf_mul(omega[i], gf_exp[(inverse * i) % 255]);
+        }
+        uint8_t derivative_value = 0;
+        for(int i = 1; i <= errors; i += 2) {
+            derivative_value ^= gf_mul(lambda[i], gf_exp[(inverse * (i - 1)) % 255]);
+        }
+        if(derivative_value == 0) {
+            return -1;
+        }
+
+        positions[found] = RS_BLOCK_SIZE - 1 - power;
+        values[found] = gf_mul(gf_exp[power], gf_div(omega_value, derivative_value));
+        found++;
+    }
+
+    if(found != errors) {
+        return -1;
+    }
+
+    for(int i = 0; i < found; i++) {
+        int j = positions[i];
+        if(j < RS_DATA_SIZE) {
+            size_t index = j * layout->codeword_count + codeword;
+            if(index >= layout->data_length) {
+                return -1; // Error in a padding symbol, which is always 0
+            }
+        }
+    }
+
+    for(int i = 0; i < found; i++) {
+        int j = positions[i];
+        if(j < RS_DATA_SIZE) {
+            layout->buffer[j * layout->codeword_count + codeword] ^= values[i];
+        }
+        else {
+            *parity_row(layout, j - RS_DATA_SIZE, codeword) ^= values[i];
+        }
+    }
+
+    return found;
+}
+
+// Layout of segment s of the encoded data
+static RsLayout segment_layout(uint8_t* buffer, size_t data_length, size_t segment) {
+    size_t segment_data_length = data_length - segment * RS_SEGMENT_DATA_SIZE;
+    if(segment_data_length > RS_SEGMENT_DATA_SIZE) segment_data_length = RS_SEGMENT_DATA_SIZE;
+
+    RsLayout layout = { buffer + segment * RS_SEGMENT_SIZE, segment_data_length, (segment_data_length + RS_DATA_SIZE - 1) / RS_DATA_SIZE };
+    return layout;
+}
+
+// Encoding writes the parity, decoding recomputes it and only corrects the code words where it differs
+static void* run_task(void* arg) {
+    RsTask* task = (RsTask*)arg;
+    uint8_t parity[RS_PARITY_SIZE][RS_MAX_KERNEL_WIDTH];
+
+    for(size_t segment = task->first; segment < task->last; segment++) {
+        RsLayout layout = segment_layout(task->buffer, task->data_length, segment);
+
+        for(size_t first = 0; first < layout.codeword_count; first += kernel_width) {
+            int count = layout.codeword_count - first < (size_t)kernel_width ? (int)(layout.codeword_count - first) : kernel_width;
+            parity_kernel(&layout, first, count, parity);
+
+            if(!task->decode) {
+                for(int p = 0; p < RS_PARITY_SIZE; p++) {
+                    memcpy(parity_row(&layout, p, first), parity[p], count);
+                }
+                continue;
+            }
+
+            uint8_t differences[RS_MAX_KERNEL_WIDTH] = { 0 };
+            for(int p = 0; p < RS_PARITY_SIZE; p++) {
+                uint8_t* stored = parity_row(&layout, p, first);
+                for(int l = 0; l < count; l++) {
+                    differences[l] |= stored[l] ^ parity[p][l];
+                }
+            }
+
+            for(int l = 0; l < count; l++) {
+                if(differences[l] == 0) continue;
+
+                int corrected = correct_codeword(&layout, first + l);
+                if(corrected < 0) task->failed_count++;
+                else task->corrected_count += corrected;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Splits the segments between the threads
+static void run_tasks(uint8_t* buffer, size_t data_length, bool decode, int thread_count, size_t* corrected_count, size_t* failed_count) {
+    if(!initialized) {
+        rs_select_implementation(RS_IMPLEMENTATION_AUTO);
+    }
+
+    size_t segment_count = (data_length + RS_SEGMENT_DATA_SIZE - 1) / RS_SEGMENT_DATA_SIZE;
+    if(thread_count < 1) thread_count = 1;
+    if((size_t)thread_count > segment_count) thread_count = segment_count > 0 ? (int)segment_count : 1;
+
+    RsTask* tasks = malloc(sizeof(RsTask) * thread_count);
+    pthread_t* threads = malloc(sizeof(pthread_t) * thread_count);
+    bool* started = malloc(sizeof(bool) * thread_count);
+
+    for(int t = 0; t < thread_count; t++) {
+        tasks[t].buffer = buffer;
+        tasks[t].data_length = data_length;
+        tasks[t].first = segment_count * t / thread_count;
+        tasks[t].last = segment_count * (t + 1) / thread_count;
+        tasks[t].decode = decode;
+        tasks[t].corrected_count = 0;
+        tasks[t].failed_count = 0;
+    }
+
+    for(int t = 1; t < thread_count; t++) {
+        started[t] = pthread_create(threads + t, NULL, run_task, tasks + t) == 0;
+        if(!started[t]) {
+            run_task(tasks + t); // Fall back to running the task on this thread
+        }
+    }
+    run_task(tasks);
+    for(int t = 1; t < thread_count; t++) {
+        if(started[t]) pthread_join(threads[t], NULL);
+    }
+
+    *corrected_count = 0;
+    *failed_count = 0;
+    for(int t = 0; t < thread_count; t++) {
+        *corrected_count += tasks[t].corrected_count;
+        *failed_count += tasks[t].failed_count;
+    }
+
+    free(started);
+    free(threads);
+    free(tasks);
+}
+
+// Moves the data of the segments apart so that the parity of each segment fits behind its data
+static void spread_segments(uint8_t* buffer, size_t data_length) {
+    size_t segment_count = (data_length + RS_SEGMENT_DATA_SIZE - 1) / RS_SEGMENT_DATA_SIZE;
+    for(size_t segment = segment_count; segment-- > 1;) {
+        size_t length = data_length - segment * RS_SEGMENT_DATA_SIZE;
+        if(length > RS_SEGMENT_DATA_SIZE) length = RS_SEGMENT_DATA_SIZE;
+        memmove(buffer + segment * RS_SEGMENT_SIZE, buffer + segment * RS_SEGMENT_DATA_SIZE, length);
+    }
+}
+
+// Moves the data of the segments back together at the start of the buffer
+static void gather_segments(uint8_t* buffer, size_t data_length) {
+    size_t segment_count = (data_length + RS_SEGMENT_DATA_SIZE - 1) / RS_SEGMENT_DATA_SIZE;
+    for(size_t segment = 1; segment < segment_count; segment++) {
+        size_t length = data_length - segment * RS_SEGMENT_DATA_SIZE;
+        if(length > RS_SEGMENT_DATA_SIZE) length = RS_SEGMENT_DATA_SIZE;
+        memmove(buffer + segment * RS_SEGMENT_DATA_SIZE, buffer + segment * RS_SEGMENT_SIZE, length);
+    }
+}
+
+// Encodes the data at the start of the buffer in place, buffer has to hold rs_encoded_length(data_length) bytes
+void rs_encode(uint8_t* buffer, size_t data_length, int thread_count) {
+    size_t corrected_count, failed_count;
+    spread_segments(buffer, data_length);
+    run_tasks(buffer, data_length, false, thread_count, &corrected_count, &failed_count);
+}
+
+// Corrects the encoded data in place and moves the data to the start of the buffer
+// Returns the number of code words which could not be corrected
+size_t rs_decode(uint8_t* buffer, size_t data_length, int thread_count, size_t* corrected_count) {
+    size_t failed_count;
+    run_tasks(buffer, data_length, true, thread_count, corrected_count, &failed_count);
+    gather_segments(buffer, data_length);
+    return failed_count;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Reed-Solomon (255, 223) code over GF(256), corrects up to 16 wrong bytes per code word
+#define RS_BLOCK_SIZE 255
+#define RS_DATA_SIZE 223
+#define RS_PARITY_SIZE 32
+
+// The encoded data consists of segments, each holding up to RS_SEGMENT_CODEWORDS interleaved code words
+// followed by their parity, so a part of the data can be corrected by decoding only the segments covering it
+// Segment s starts at s * RS_SEGMENT_SIZE of the encoded data and at s * RS_SEGMENT_DATA_SIZE of the data
+#define RS_SEGMENT_CODEWORDS 64
+#define RS_SEGMENT_DATA_SIZE (RS_SEGMENT_CODEWORDS * RS_DATA_SIZE)
+#define RS_SEGMENT_SIZE (RS_SEGMENT_CODEWORDS * RS_BLOCK_SIZE)
+
+typedef enum RsImplementation {
+    RS_IMPLEMENTATION_AUTO,
+    RS_IMPLEMENTATION_SCALAR,
+    RS_IMPLEMENTATION_SSSE3,
+    RS_IMPLEMENTATION_AVX2
+} RsImplementation;
+
+void rs_select_implementation(RsImplementation implementation);
+size_t rs_encoded_length(size_t data_length);
+size_t rs_max_data_length(size_t encoded_length);
+void rs_encode(uint8_t* buffer, size_t data_length, int thread_count);
+size_t rs_decode(uint8_t* buffer, size_t data_length, int thread_count, size_t* corrected_count);